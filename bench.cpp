@@ -0,0 +1,1022 @@
+// Headless micro-benchmarks, run all or the ones named on command line
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <sys/time.h>
+#include "canvas.h"
+#include "lighting.h"
+#include "postfx.h"
+#include "ssao.h"
+#include "supersample.h"
+#include "pipeline.h"
+
+// Enough of the demo's vertex buffer for bunny.h
+template <typename T>
+struct MeshArray {
+    const T *data;
+    size_t size;
+};
+
+struct VertexBuffer {
+    MeshArray<float> vertices;
+    MeshArray<int> indeces;
+    MeshArray<float> normals;
+    MeshArray<float> texcoords;
+};
+
+#include "bunny.h"
+
+static const PixelFormat xrgb = {
+    4,
+    0xFF0000, 0x00FF00, 0x0000FF, 0,
+    16, 8, 0, 24,
+    0, 0, 0, 8
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+static Pixman noiseTexture(uint32_t size)
+{
+    Pixman tex(size, size, xrgb);
+    uint32_t seed = 1;
+
+    for (uint32_t y = 0; y < size; y++)
+        for (uint32_t x = 0; x < size; x++) {
+            seed = seed*1103515245 + 12345;
+            tex.set(x, y, seed >> 8 & 0xFFFFFF);
+        }
+
+    return tex;
+}
+
+static Vertex screenVertex(float x, float y, float u, float v)
+{
+    Vertex vt;
+    vt[0] = roundf(x);
+    vt[1] = roundf(y);
+    vt[2] = 1;
+    vt[3] = u;
+    vt[4] = v;
+    return vt;
+}
+
+// Screen aligned square rotated by angle, covering the whole texture
+static void squareTriangles(const Canvas &c, float angle, float half,
+                            float tsize, Vertex t[3], Vertex t2[3])
+{
+    static const float corners[4][2] = { {-1, -1}, {1, -1}, {1, 1}, {-1, 1} };
+    float cx = c.width()/2, cy = c.height()/2;
+    float ca = cosf(angle), sa = sinf(angle);
+    Vertex q[4];
+
+    for (int i = 0; i < 4; i++) {
+        float x = corners[i][0]*half, y = corners[i][1]*half;
+        q[i] = screenVertex(cx + x*ca - y*sa, cy + x*sa + y*ca,
+                            (corners[i][0]+1)/2*(tsize-1),
+                            (corners[i][1]+1)/2*(tsize-1));
+    }
+    t[0] = t2[0] = q[0];
+    t[1] = q[1];
+    t[2] = t2[1] = q[2];
+    t2[2] = q[3];
+}
+
+static void texturedSquare(Canvas &c, float angle, float half, float tsize,
+                           bool depthOnly = false)
+{
+    Vertex t[3], t2[3];
+    squareTriangles(c, angle, half, tsize, t, t2);
+    if (depthOnly) {
+        c.depthTriangle(t);
+        c.depthTriangle(t2);
+    } else {
+        c.triangle(t);
+        c.triangle(t2);
+    }
+}
+
+template <typename T>
+static double texelRate(Canvas &c, const T *tex, float angle, float half)
+{
+    const int frames = 20;
+    c.texture(tex);
+
+    double t = now();
+    for (int i = 0; i < frames; i++) {
+        c.clear();
+        texturedSquare(c, angle, half, tex->width());
+    }
+    t = now() - t;
+
+    return 4*half*half*frames/t;
+}
+
+// Nearest texel of level 0, the same code for either storage
+template <typename T>
+struct FetchShader : PixelShader {
+    enum { ATTRIBS = 2 };
+    const T &tex;
+
+    FetchShader(const T &t) : tex(t) {}
+    bool operator()(const float *uv, uint32_t &c) const
+    {
+        c = tex.get(uv[0], uv[1]);
+        return true;
+    }
+};
+
+// Best of a few rounds after a warm up frame
+template <typename T>
+static double fetchRate(Canvas &c, const T &tex, float angle, float half)
+{
+    const int frames = 4, rounds = 5;
+    FetchShader<T> shader(tex);
+    Vertex t[3], t2[3];
+    squareTriangles(c, angle, half, tex.width(), t, t2);
+
+    c.clear();
+    c.triangle(t, shader);
+    c.triangle(t2, shader);
+    double best = 1e30;
+    for (int r = 0; r < rounds; r++) {
+        double s = 0;
+        for (int i = 0; i < frames; i++) {
+            c.clear();
+            double t0 = now();
+            c.triangle(t, shader);
+            c.triangle(t2, shader);
+            s += now() - t0;
+        }
+        best = std::min(best, s);
+    }
+
+    return 4*half*half*frames/best;
+}
+
+// Row-major against 4x4 tiles through the same shader, no mips. The
+// texture is bigger than the last level cache of most machines.
+static void benchTexelFetch()
+{
+    const uint32_t tsize = 2048;
+    const float half = 1024;
+    Pixman surf(2900, 2900, xrgb);
+    Canvas c(surf);
+    Pixman linear = noiseTexture(tsize);
+    PixelView<FormatXRGB8888> view(linear);
+    Texture tiled(linear, false);
+
+    printf("texel fetch, %ux%u texture, Mtexel/s\n", tsize, tsize);
+    printf("%8s %10s %10s\n", "angle", "linear", "tiled");
+    for (int deg = 0; deg <= 90; deg += 15) {
+        float a = deg*M_PI/180;
+        printf("%8d %10.1f %10.1f\n", deg,
+               fetchRate(c, view, a, half)/1e6,
+               fetchRate(c, tiled, a, half)/1e6);
+    }
+}
+
+// Minified texture: without mips every pixel hits a different line
+static void benchMipmap()
+{
+    const uint32_t tsize = 2048;
+    const float half = 128;
+    Pixman surf(512, 512, xrgb);
+    Canvas c(surf);
+    Pixman src = noiseTexture(tsize);
+    Texture flat(src, false);
+    Texture mipped(src);
+    static const char *names[] = { "nearest", "bilinear", "trilinear" };
+
+    printf("%ux%u texture on %gx%g square, Mpixel/s\n",
+           tsize, tsize, 2*half, 2*half);
+    printf("%10s %10s %10s\n", "filter", "no mips", "mips");
+    for (int f = Texture::NEAREST; f <= Texture::TRILINEAR; f++) {
+        c.filter((Texture::Filter)f);
+        double a = texelRate(c, &flat, 0.3f, half);
+        double b = texelRate(c, &mipped, 0.3f, half);
+        printf("%10s %10.1f %10.1f\n", names[f], a/1e6, b/1e6);
+    }
+}
+
+static void benchPerspective()
+{
+    Pixman surf(1024, 1024, xrgb);
+    Canvas c(surf);
+    Texture tex(noiseTexture(512));
+    static const int steps[] = { 0, 1, 4, 8, 16, 32 };
+
+    printf("perspective step, Mpixel/s (0 is affine)\n");
+    for (size_t i = 0; i < sizeof(steps)/sizeof(steps[0]); i++) {
+        c.perspective(steps[i]);
+        printf("%8d %10.1f\n", steps[i], texelRate(c, &tex, 0.3f, 360)/1e6);
+    }
+}
+
+// Depth only path against shaded ones, z-buffer cleared between frames
+static void benchDepth()
+{
+    Pixman surf(1024, 1024, xrgb);
+    Canvas c(surf);
+    Texture tex(noiseTexture(512));
+    const float half = 360;
+    const int frames = 20;
+    static const char *names[] = { "textured", "flat", "depth" };
+
+    printf("%gx%g square, Mpixel/s\n", 2*half, 2*half);
+    for (int mode = 0; mode < 3; mode++) {
+        c.texture(mode == 0 ? &tex : (const Texture*)NULL);
+        double t = 0;
+        for (int i = 0; i < frames; i++) {
+            c.clearDepth();
+            double start = now();
+            texturedSquare(c, 0.3f, half, tex.width(), mode == 2);
+            t += now() - start;
+        }
+        printf("%10s %10.1f\n", names[mode], 4*half*half*frames/t/1e6);
+    }
+}
+
+// Flat square with the stencil untouched, kept through depth writes, and
+// tested against a mask of half the square drawn by depthTriangle()
+static void benchStencil()
+{
+    Pixman surf(1024, 1024, xrgb);
+    Canvas c(surf);
+    const float half = 360;
+    const int frames = 20;
+    static const char *names[] = { "off", "kept", "tested" };
+
+    printf("%gx%g square, Mpixel/s\n", 2*half, 2*half);
+    for (int mode = 0; mode < 3; mode++) {
+        c.clear();
+        c.stencil(mode > 0);
+        c.stencilFunc(Canvas::ALWAYS, 1);
+        c.stencilOp(Canvas::KEEP, Canvas::KEEP, Canvas::REF);
+        if (mode > 0) {
+            Vertex v[3] = {
+                screenVertex(0, 0, 0, 0), screenVertex(1023, 0, 0, 0),
+                screenVertex(0, 1023, 0, 0)
+            };
+            c.depthWrite(false);
+            c.depthTriangle(v);
+            c.depthWrite(true);
+        }
+        c.stencil(mode == 2);
+        c.stencilFunc(Canvas::EQUAL, 1);
+        c.stencilOp(Canvas::KEEP, Canvas::KEEP, Canvas::INCR);
+
+        double t = 0;
+        for (int i = 0; i < frames; i++) {
+            c.clearDepth();
+            double start = now();
+            texturedSquare(c, 0.3f, half, 0);
+            t += now() - start;
+        }
+        printf("%10s %10.1f\n", names[mode], 4*half*half*frames/t/1e6);
+    }
+}
+
+// Each blend mode over the last frame, flat and textured, depth writes
+// off as for transparent geometry
+static void benchBlend()
+{
+    Pixman surf(1024, 1024, xrgb);
+    Canvas c(surf);
+    Texture tex(noiseTexture(512));
+    const float half = 360;
+    const int frames = 20;
+    static const char *names[] = { "replace", "alpha", "additive", "premul" };
+
+    // Every alpha against random pixels, the odd count leaves a tail
+    // for the scalar loop
+    const int n = 256*64 + 3;
+    std::vector<uint32_t> src(n), dst(n), span, ref;
+    uint32_t seed = 1;
+    for (int i = 0; i < n; i++) {
+        seed = seed*1103515245 + 12345;
+        dst[i] = seed >> 8;
+        seed = seed*1103515245 + 12345;
+        src[i] = (seed >> 8 & 0xFFFFFF) | (uint32_t)(i & 0xFF) << 24;
+    }
+
+    printf("%gx%g square, Mpixel/s      flat   textured\n", 2*half, 2*half);
+    c.alpha(0x80);
+    c.depthWrite(false);
+    for (int mode = Canvas::REPLACE; mode <= Canvas::PREMULTIPLIED; mode++) {
+        c.blend((Canvas::Blend)mode);
+        printf("%10s", names[mode]);
+        for (int textured = 0; textured < 2; textured++) {
+            c.texture(textured ? &tex : (const Texture*)NULL);
+            c.clear();
+            double t = now();
+            for (int i = 0; i < frames; i++)
+                texturedSquare(c, 0.3f, half, tex.width());
+            t = now() - t;
+            printf(" %10.1f", 4*half*half*frames/t/1e6);
+        }
+
+        // Span against blendRGB() pixel by pixel
+        span = ref = dst;
+        blendSpan(&span[0], &src[0], n, (Canvas::Blend)mode);
+        for (int i = 0; i < n; i++)
+            ref[i] = blendRGB(ref[i], src[i], (Canvas::Blend)mode);
+        printf(" %s\n", span == ref ? "" : "differs");
+    }
+}
+
+// Bunny seen from the front, size pixels tall, z eye depth of its center
+static void drawBunny(Canvas &c, float cx, float cy, float size, float z,
+                      bool wire = false)
+{
+    const float s = size/0.15f;
+    for (size_t i = 0; i < vb.indeces.size; i++) {
+        Vertex v[3];
+        for (int j = 0; j < 3; j++) {
+            const float *p = &vb.vertices.data[3*vb.indeces.data[3*i+j]];
+            v[j] = screenVertex(cx + p[0]*s, cy - (p[1] - 0.1f)*s, 0, 0);
+            v[j][2] = z + p[2]*7;
+        }
+        if (wire) {
+            c.line(v[0], v[1]);
+            c.line(v[1], v[2]);
+            c.line(v[2], v[0]);
+        } else
+            c.triangle(v);
+    }
+}
+
+// The bunny's wireframe with aliased lines and antialiased ones, which
+// should stay within twice the time. Clears aren't timed, the best of a
+// few rounds counts.
+static void benchLines()
+{
+    const int w = 1024, h = 768;
+    const int frames = 20, rounds = 5;
+    Pixman surf(w, h, xrgb);
+    Canvas c(surf);
+    c.setColor(255, 255, 255);
+
+    double rate[2];
+    printf("bunny wireframe, %d lines, Mlines/s\n", 3*(int)vb.indeces.size);
+    for (int aa = 0; aa < 2; aa++) {
+        c.smoothLines(aa);
+        double best = 1e30;
+        for (int r = 0; r < rounds; r++) {
+            double t = 0;
+            for (int i = 0; i < frames; i++) {
+                c.clear();
+                double t0 = now();
+                drawBunny(c, w/2, h/2, h*0.9f, 3, true);
+                t += now() - t0;
+            }
+            best = std::min(best, t);
+        }
+        rate[aa] = 3.*vb.indeces.size*frames/best/1e6;
+        printf("%8s %10.2f\n", aa ? "smooth" : "aliased", rate[aa]);
+    }
+    printf("%8s %10.2fx\n", "ratio", rate[0]/rate[1]);
+}
+
+// A row of bunnies poking into each other, blended in draw order against
+// fragment lists with a budget big enough and one too small
+static void benchOIT()
+{
+    const int w = 1024, h = 768;
+    const int bunnies = 6, frames = 10;
+    Pixman surf(w, h, xrgb);
+    Canvas c(surf);
+    static const size_t budgets[] = { 0, 1 << 22, 1 << 18 };
+
+    printf("%d overlapping bunnies, %d triangles each\n", bunnies,
+           (int)vb.indeces.size);
+    printf("%8s %8s %8s %8s %8s %8s %8s %8s\n", "budget", "draw ms",
+           "Mfrag/s", "resolve", "stored", "overflow", "longest", "MB");
+    for (size_t k = 0; k < sizeof(budgets)/sizeof(budgets[0]); k++) {
+        c.orderIndependent(budgets[k]);
+        c.blend(Canvas::ALPHA);
+        c.depthWrite(false);
+        c.alpha(0x60);
+        double draw = 0, resolve = 0;
+        for (int i = 0; i < frames; i++) {
+            c.clear();
+            double t = now();
+            for (int b = 0; b < bunnies; b++) {
+                c.setColor(80 + 30*b, 200 - 25*b, 120);
+                drawBunny(c, w*(b + 1.f)/(bunnies + 1), h/2, h*0.7f,
+                          3 + 0.2f*(b & 1));
+            }
+            double t1 = now();
+            c.resolve();
+            draw += t1 - t;
+            resolve += now() - t1;
+        }
+        printf("%8zu %8.2f", budgets[k], draw*1e3/frames);
+        if (budgets[k]) {
+            const Canvas::FragmentStats &st = c.fragmentStats();
+            printf(" %8.1f %8.2f %8zu %8zu %8zu %8.1f",
+                   (st.stored + st.overflow)*frames/draw/1e6,
+                   resolve*1e3/frames, st.stored, st.overflow, st.longest,
+                   st.bytes/1048576.);
+        }
+        printf("\n");
+    }
+}
+
+// Rotated grid of small flat triangles, every edge is between two of
+// them or the background
+static void benchMultisample()
+{
+    const int size = 1024, cells = 48;
+    const float half = 360;
+    const int frames = 10;
+    Pixman surf(size, size, xrgb);
+    Canvas c(surf);
+    float ca = cosf(0.3f), sa = sinf(0.3f), cell = 2*half/cells;
+    std::vector<Vertex> grid;
+    for (int y = 0; y <= cells; y++)
+        for (int x = 0; x <= cells; x++) {
+            float gx = x*cell - half, gy = y*cell - half;
+            Vertex v;
+            v[0] = size/2 + gx*ca - gy*sa;
+            v[1] = size/2 + gx*sa + gy*ca;
+            v[2] = 1 + 0.001f*(x + y);
+            v[3] = v[4] = 0;
+            grid.push_back(v);
+        }
+
+    // Layers after the first are shifted half a cell and drawn in
+    // front, covering whole most edge pixels of the ones before
+    auto draw = [&](int layers) {
+        c.clear();
+        for (int l = 0; l < layers; l++)
+            for (int y = 0; y < cells; y++)
+                for (int x = 0; x < cells; x++) {
+                    Vertex v[4] = { grid[y*(cells+1) + x], grid[y*(cells+1) + x+1],
+                                    grid[(y+1)*(cells+1) + x],
+                                    grid[(y+1)*(cells+1) + x+1] };
+                    for (int i = 0; i < 4; i++) {
+                        v[i][0] += l*cell/2;
+                        v[i][1] += l*cell/2;
+                        v[i][2] -= l*0.5f;
+                    }
+                    Vertex t0[3] = { v[0], v[1], v[3] };
+                    Vertex t1[3] = { v[0], v[3], v[2] };
+                    c.setColor(x*5, y*5, 128 + l*64);
+                    c.triangle(t0);
+                    c.setColor(y*5, 128 + l*64, x*5);
+                    c.triangle(t1);
+                }
+    };
+
+    printf("%dx%d grid of %gpx cells, Mpixel/s, sampled pixels, "
+           "sample memory\n", cells, cells, cell);
+    static const int counts[] = { 1, 2, 4, 8 };
+    for (int k = 0; k < 4; k++) {
+        c.multisample(counts[k]);
+        size_t sampled = 0;
+        double t = now();
+        for (int i = 0; i < frames; i++) {
+            draw(1);
+            sampled = c.samples() > 1 ? c.sampledPixels() : 0;
+            c.resolve();
+        }
+        t = now() - t;
+        // Slot and index against a color and depth for every sample
+        double packed = (double)sampled*counts[k]*8 + (double)size*size*4;
+        double flat = (double)size*size*counts[k]*8;
+        printf("%8dx %10.1f %10zu %9.0f%%\n", counts[k],
+               4*half*half*frames/t/1e6, sampled,
+               counts[k] > 1 ? 100*packed/flat : 100.);
+    }
+
+    printf("4x, layers of the grid over each other, sampled pixels "
+           "against slots in storage\n");
+    c.multisample(4);
+    for (int layers = 1; layers <= 4; layers++) {
+        draw(layers);
+        printf("%8d %10zu %10zu\n", layers, c.sampledPixels(), c.sampleSlots());
+        c.resolve();
+    }
+}
+
+// The textured square drawn whole, then again tile by tile with the
+// scissor, every tile submitting both triangles. Tiles must give the
+// same image.
+static void benchScissor()
+{
+    const int size = 1024, frames = 10;
+    const float half = 360;
+    Pixman surf(size, size, xrgb);
+    Canvas c(surf);
+    Texture tex(noiseTexture(512));
+    std::vector<uint32_t> whole;
+    static const int tilings[] = { 1, 2, 4, 8, 16 };
+
+    c.texture(&tex);
+    printf("%gx%g square in n x n tiles, Mpixel/s\n", 2*half, 2*half);
+    for (size_t k = 0; k < sizeof(tilings)/sizeof(tilings[0]); k++) {
+        const int n = tilings[k], tile = size/n;
+        double t = now();
+        for (int i = 0; i < frames; i++)
+            for (int ty = 0; ty < n; ty++)
+                for (int tx = 0; tx < n; tx++) {
+                    c.scissor(tx*tile, ty*tile, tile, tile);
+                    c.clear();
+                    texturedSquare(c, 0.3f, half, tex.width());
+                }
+        t = now() - t;
+        c.scissor();
+
+        const uint32_t *p = (const uint32_t*)c.frame().pixels();
+        std::vector<uint32_t> image(p, p + size*size);
+        if (whole.empty())
+            whole = image;
+        printf("%8d %10.1f %s\n", n, 4*half*half*frames/t/1e6,
+               image == whole ? "" : "differs");
+    }
+}
+
+// A still grid of textured squares and one square moving over it,
+// redrawn whole every frame, only where the moving one is and was, or
+// the moving one over the grid kept in a layer
+static void benchRedraw()
+{
+    enum { WHOLE, PARTIAL, LAYER, MODES };
+    const int w = 1024, h = 768, frames = 60;
+    Pixman surf(w, h, xrgb);
+    Canvas c(surf);
+    Canvas::Layer layer;
+    Texture tex(noiseTexture(256));
+    std::vector<uint32_t> image[MODES];
+    double ms[MODES];
+    int dirty = 0;
+
+    auto square = [&](float cx, float cy, float half, float angle) {
+        static const float corners[4][2] = { {-1, -1}, {1, -1}, {1, 1}, {-1, 1} };
+        float ca = cosf(angle), sa = sinf(angle);
+        Vertex q[4];
+        for (int i = 0; i < 4; i++) {
+            float x = corners[i][0]*half, y = corners[i][1]*half;
+            q[i] = screenVertex(cx + x*ca - y*sa, cy + x*sa + y*ca,
+                                (corners[i][0]+1)/2*255, (corners[i][1]+1)/2*255);
+        }
+        Vertex t[3] = { q[0], q[1], q[2] };
+        Vertex t2[3] = { q[0], q[2], q[3] };
+        c.triangle(t);
+        c.triangle(t2);
+    };
+    // Bounds of the moving square in frame i, with a pixel to spare
+    auto moving = [&](int i) {
+        float cx = 100 + i*12, cy = h/2, r = 60*1.4143f + 1;
+        Canvas::Rect b = { int(cx - r), int(cy - r), int(cx + r), int(cy + r) };
+        return b;
+    };
+    auto still = [&]() {
+        c.clear();
+        for (int y = 0; y < 8; y++)
+            for (int x = 0; x < 11; x++)
+                square(60 + x*92, 60 + y*92, 40, 0.2f);
+    };
+    auto move = [&](int i) {
+        Canvas::Rect b = moving(i);
+        square((b.x0 + b.x1)/2.f, (b.y0 + b.y1)/2.f, 60, i*0.05f);
+    };
+
+    c.texture(&tex);
+    for (int mode = 0; mode < MODES; mode++) {
+        c.scissor();
+        still();
+        if (mode == LAYER)
+            c.save(layer);
+        move(0);
+        double t = now();
+        for (int i = 1; i < frames; i++) {
+            if (mode == LAYER) {
+                c.restore(layer);
+                move(i);
+                continue;
+            }
+            if (mode == PARTIAL) {
+                Canvas::Rect r = moving(i).join(moving(i-1));
+                c.scissor(r);
+                dirty += r.area();
+            }
+            still();
+            move(i);
+        }
+        ms[mode] = (now() - t)*1e3/(frames-1);
+        const uint32_t *p = (const uint32_t*)c.frame().pixels();
+        image[mode].assign(p, p + w*h);
+    }
+    c.scissor();
+
+    printf("%dx%d, 88 still squares and a moving one, ms/frame\n", w, h);
+    printf("%10s %10s %10s %10s\n", "whole", "partial", "layer", "dirty");
+    printf("%10.2f %10.2f %10.2f %9.1f%% %s\n", ms[WHOLE], ms[PARTIAL],
+           ms[LAYER], 100.*dirty/(frames-1)/(w*h),
+           image[PARTIAL] == image[WHOLE] && image[LAYER] == image[WHOLE]
+           ? "" : "differs");
+}
+
+// Textured square over most of a 1024x768 still, rendered in bands at
+// factor times the size and filtered down
+static void benchSupersample()
+{
+    const int w = 1024, h = 768;
+    Pixman out(w, h, xrgb);
+    Texture tex(noiseTexture(512));
+    static const float corners[4][2] = { {-1, -1}, {1, -1}, {1, 1}, {-1, 1} };
+    static const char *names[] = { "box", "lanczos" };
+
+    printf("%dx%d still, ms total and filtering only\n", w, h);
+    for (int factor = 2; factor <= 4; factor *= 2)
+        for (int f = 0; f < 2; f++) {
+            Supersampler ss(w, h, factor, (Supersampler::Filter)f);
+            Canvas &c = ss.canvas();
+            c.texture(&tex);
+            float half = 340*factor, ca = cosf(0.3f), sa = sinf(0.3f);
+            double draw = 0, t = now();
+            ss.render(out, [&](int y) {
+                double start = now();
+                Vertex q[4];
+                for (int i = 0; i < 4; i++) {
+                    float x = corners[i][0]*half, v = corners[i][1]*half;
+                    q[i] = screenVertex(ss.width()/2 + x*ca - v*sa,
+                                        ss.height()/2 + x*sa + v*ca - y,
+                                        (corners[i][0]+1)/2*511,
+                                        (corners[i][1]+1)/2*511);
+                }
+                Vertex t0[3] = { q[0], q[1], q[2] };
+                Vertex t1[3] = { q[0], q[2], q[3] };
+                c.clear();
+                c.triangle(t0);
+                c.triangle(t1);
+                draw += now() - start;
+            });
+            t = now() - t;
+            printf("%dx %8s %8.1f %8.1f\n", factor, names[f], t*1e3,
+                   (t - draw)*1e3);
+        }
+}
+
+// Texture color and a facing normal, a G-buffer in one pass
+struct ColorNormalShader : PixelShader {
+    enum { ATTRIBS = 2, OUTPUTS = 2 };
+    const Texture &tex;
+
+    ColorNormalShader(const Texture &t) : tex(t) {}
+    bool operator()(const float *uv, uint32_t *c) const
+    {
+        c[0] = tex.nearest(uv[0], uv[1], 0);
+        c[1] = 0x7F7FFF;
+        return true;
+    }
+};
+
+// Two outputs from one raster pass against a pass per target
+static void benchTargets()
+{
+    const int size = 1024;
+    const float half = 360;
+    const int frames = 20;
+    Pixman surf(size, size, xrgb);
+    Canvas c(surf);
+    Pixman normals(size, size, xrgb);
+    Texture tex(noiseTexture(512));
+    float ts = tex.width()-1;
+    Vertex q[4] = {
+        screenVertex(size/2-half, size/2-half, 0, 0),
+        screenVertex(size/2+half, size/2-half, ts, 0),
+        screenVertex(size/2+half, size/2+half, ts, ts),
+        screenVertex(size/2-half, size/2+half, 0, ts),
+    };
+    Vertex t0[3] = { q[0], q[1], q[2] };
+    Vertex t1[3] = { q[0], q[2], q[3] };
+    uint32_t n = 0x7F7FFF;
+    auto normal = shader<0>([n](const float*, uint32_t &c) {
+        c = n;
+        return true;
+    });
+
+    printf("%gx%g square, color and normal, Mpixel/s\n", 2*half, 2*half);
+    double t = now();
+    for (int i = 0; i < frames; i++) {
+        c.clear();
+        c.texture(&tex);
+        c.triangle(t0);
+        c.triangle(t1);
+        c.target(&normals);
+        c.clearDepth();
+        c.triangle(t0, normal);
+        c.triangle(t1, normal);
+        c.target(NULL);
+    }
+    t = now() - t;
+    printf("%10s %10.1f\n", "2 passes", 4*half*half*frames/t/1e6);
+
+    c.target(&normals, 1);
+    t = now();
+    for (int i = 0; i < frames; i++) {
+        c.clear();
+        c.triangle(t0, ColorNormalShader(tex));
+        c.triangle(t1, ColorNormalShader(tex));
+    }
+    t = now() - t;
+    printf("%10s %10.1f\n", "mrt", 4*half*half*frames/t/1e6);
+    c.target(NULL, 1);
+}
+
+// All effects fused in one tile pass against a full frame pass each
+static void benchPost()
+{
+    const int size = 1024;
+    const int frames = 10;
+    Pixman src = noiseTexture(size);
+    Pixman tmp(size, size, xrgb), dst(size, size, xrgb);
+    PostProcess fx[4], fused;
+    fx[0].tonemap(2);
+    fx[1].blur(2);
+    fx[2].fxaa();
+    fx[3].vignette(0.5f);
+    fused.tonemap(2);
+    fused.blur(2);
+    fused.fxaa();
+    fused.vignette(0.5f);
+
+    printf("%dx%d tonemap, blur, fxaa, vignette, Mpixel/s\n", size, size);
+    double t = now();
+    for (int i = 0; i < frames; i++) {
+        fx[0].run(src, dst);
+        for (int j = 1; j < 4; j++) {
+            std::swap(tmp, dst);
+            fx[j].run(tmp, dst);
+        }
+    }
+    t = now() - t;
+    printf("%10s %10.1f\n", "separate", (double)size*size*frames/t/1e6);
+
+    t = now();
+    for (int i = 0; i < frames; i++)
+        fused.run(src, dst);
+    t = now() - t;
+    printf("%10s %10.1f\n", "fused", (double)size*size*frames/t/1e6);
+}
+
+// The textured square rendered on the pipeline's thread while the
+// frame before is post-processed, as presenting it would
+static void benchPipeline()
+{
+    const int size = 1024, frames = 40;
+    const float half = 360;
+    Pixman surf(size, size, xrgb), out(size, size, xrgb);
+    Texture tex(noiseTexture(512));
+    PostProcess post;
+    post.fxaa();
+    post.vignette(0.5f);
+    std::vector<uint32_t> last;
+
+    printf("%dx%d square then fxaa and vignette, %d frames\n", size, size, frames);
+    printf("%8s %10s %10s %10s\n", "buffers", "frames/s", "latency", "max");
+    for (int buffers = 1; buffers <= 3; buffers++) {
+        FramePipeline pipe(surf, buffers);
+        for (int i = 0; i < buffers; i++)
+            pipe.canvas(i).texture(&tex);
+
+        pipe.start([&](int i, int n) {
+            Canvas &c = pipe.canvas(i);
+            c.clear();
+            texturedSquare(c, n*0.02f, half, tex.width());
+        });
+        for (int n = 0; n < frames; n++) {
+            int i = pipe.acquire();
+            pipe.canvas(i).resolve();
+            post.run(pipe.canvas(i).frame(), out);
+            pipe.release(i);
+        }
+        pipe.stop();
+
+        FramePipeline::Stats s = pipe.stats();
+        const uint32_t *p = (const uint32_t*)out.pixels();
+        bool same = last.empty() || std::equal(last.begin(), last.end(), p);
+        last.assign(p, p + size*size);
+        printf("%8d %10.1f %8.1fms %8.1fms %s\n", buffers, s.frames/s.elapsed,
+               s.latency*1e3, s.maxLatency*1e3, same ? "" : "differs");
+    }
+}
+
+// Eye space quad through (x, y, z) corners, flat shaded
+static void eyeQuad(Canvas &c, float f, const float q[4][3])
+{
+    Vertex v[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = screenVertex(c.width()/2 + f*q[i][0]/q[i][2],
+                            c.height()/2 - f*q[i][1]/q[i][2], 0, 0);
+        v[i][2] = q[i][2];
+    }
+    Vertex t0[3] = { v[0], v[1], v[2] };
+    Vertex t1[3] = { v[0], v[2], v[3] };
+    c.triangle(t0);
+    c.triangle(t1);
+}
+
+// Pillars standing on a floor, the creases get occluded
+static void benchSSAO()
+{
+    const int w = 1024, h = 768;
+    const int frames = 10;
+    Pixman surf(w, h, xrgb);
+    Canvas c(surf);
+    AmbientOcclusion ao;
+    float f = w/2;
+
+    printf("%dx%d floor and pillars, ms per pass\n", w, h);
+    AmbientOcclusion::Cost sum = { 0, 0, 0 };
+    for (int i = 0; i < frames; i++) {
+        c.clear();
+        c.setColor(200, 200, 200);
+        const float floor[4][3] = {
+            { -4, -1, 1.5f }, { 4, -1, 1.5f }, { 4, -1, 8 }, { -4, -1, 8 }
+        };
+        eyeQuad(c, f, floor);
+        for (int j = 0; j < 16; j++) {
+            float x = (j%4 - 1.5f)*1.2f, z = 2.5f + j/4*1.2f;
+            const float pillar[4][3] = {
+                { x-0.2f, -1, z }, { x+0.2f, -1, z },
+                { x+0.2f, 0.5f, z }, { x-0.2f, 0.5f, z }
+            };
+            eyeQuad(c, f, pillar);
+        }
+
+        ao.apply(c);
+        sum.downsample += ao.cost().downsample;
+        sum.occlusion += ao.cost().occlusion;
+        sum.upsample += ao.cost().upsample;
+    }
+    printf("%12s %8.2f\n", "downsample", sum.downsample*1e3/frames);
+    printf("%12s %8.2f\n", "occlusion", sum.occlusion*1e3/frames);
+    printf("%12s %8.2f\n", "upsample", sum.upsample*1e3/frames);
+    double t = sum.downsample + sum.occlusion + sum.upsample;
+    printf("%12s %8.1f\n", "Mpixel/s", (double)w*h*frames/t/1e6);
+}
+
+// Unit sphere, normals are the positions
+static void benchLighting()
+{
+    const size_t n = 1 << 16;
+    std::vector<float> pos(n*3);
+    std::vector<vec3f> colors(n);
+    uint32_t seed = 1;
+
+    for (size_t i = 0; i < n; i++) {
+        float v[3], len = 0;
+        for (int j = 0; j < 3; j++) {
+            seed = seed*1103515245 + 12345;
+            v[j] = (seed >> 8 & 0xFFFF) / 32768.f - 1;
+            len += v[j]*v[j];
+        }
+        len = sqrtf(len) + 1e-6f;
+        for (int j = 0; j < 3; j++)
+            pos[i*3+j] = v[j] / len;
+    }
+
+    std::vector<Light> lights(64);
+    for (size_t i = 0; i < lights.size(); i++) {
+        float a = i * 0.7f;
+        Light &l = lights[i];
+        l.position = vec4(cosf(a), sinf(a), -1.f, i & 1 ? 1.f : 0.f);
+        l.color = vec3(0.2f, 0.2f, 0.2f);
+        l.radius = 3;
+    }
+
+    Material m = {
+        vec4(0.1f, 0.1f, 0.1f, 1.f),
+        vec4(0.8f, 0.8f, 0.8f, 1.f),
+        vec4(0.5f, 0.5f, 0.5f, 1.f),
+        32
+    };
+    Matrix4f mv = translate(0.f, 0.f, 3.f);
+
+    printf("%zu vertices, half point lights, Mvertex/s\n", n);
+    for (int nl = 1; nl <= 64; nl *= 2) {
+        const int rounds = 20;
+        double t = now();
+        for (int i = 0; i < rounds; i++)
+            lightVertices(mv, m, &lights[0], nl, &pos[0], &pos[0], n,
+                          &colors[0]);
+        t = now() - t;
+        printf("%8d %10.1f\n", nl, rounds*n/t/1e6);
+    }
+}
+
+// Normals of a floor tilted away from the eye, lit by scattered point
+// lights just above it
+static void benchTiled()
+{
+    const int size = 512;
+    Pixman surf(size, size, xrgb);
+    Canvas c(surf);
+    Projection proj = { size/2.f, size/2.f, size/2.f, size/2.f };
+    // Floor is y = -1, z from 1.5 to 6
+    float zn = 1.5f, zf = 6;
+    VertexN<3> q[4];
+    for (int i = 0; i < 4; i++) {
+        float x = i & 1 ? 3 : -3;
+        float z = i & 2 ? zf : zn;
+        q[i][0] = roundf(proj.cx + proj.fx*x/z);
+        q[i][1] = roundf(proj.cy + proj.fy/z);
+        q[i][2] = z;
+        q[i][3] = 0;
+        q[i][4] = 1;
+        q[i][5] = 0;
+    }
+    VertexN<3> t0[3] = { q[0], q[1], q[2] };
+    VertexN<3> t1[3] = { q[1], q[3], q[2] };
+
+    std::vector<Light> lights(1024);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < lights.size(); i++) {
+        float r[2];
+        for (int j = 0; j < 2; j++) {
+            seed = seed*1103515245 + 12345;
+            r[j] = (seed >> 8 & 0xFFFF) / 65536.f;
+        }
+        Light &l = lights[i];
+        l.position = vec4(r[0]*6 - 3, -0.8f, zn + r[1]*(zf-zn), 1.f);
+        l.color = vec3(0.3f, 0.3f, 0.3f);
+        l.radius = 0.4f;
+    }
+
+    Material m = {
+        vec4(0.1f, 0.1f, 0.1f, 1.f),
+        vec4(0.8f, 0.8f, 0.8f, 1.f),
+        vec4(0.5f, 0.5f, 0.5f, 1.f),
+        32
+    };
+
+    printf("%dx%d per pixel point lights, Mpixel/s\n", size, size);
+    printf("%8s %10s %10s\n", "lights", "all", "culled");
+    for (int nl = 1; nl <= 1024; nl *= 4) {
+        double rate[2];
+        for (int cull = 0; cull < 2; cull++) {
+            const int frames = 5;
+            double t = 0;
+            for (int i = 0; i < frames; i++) {
+                c.clear();
+                c.triangle(t0, NormalShader());
+                c.triangle(t1, NormalShader());
+                double start = now();
+                shadeTiled(c, proj, m, &lights[0], nl, cull);
+                t += now() - start;
+            }
+            rate[cull] = (double)size*size*frames/t;
+        }
+        printf("%8d %10.1f %10.1f\n", nl, rate[0]/1e6, rate[1]/1e6);
+    }
+}
+
+struct Bench {
+    const char *name;
+    void (*run)();
+};
+
+static const Bench benches[] = {
+    { "texel", benchTexelFetch },
+    { "mipmap", benchMipmap },
+    { "perspective", benchPerspective },
+    { "depth", benchDepth },
+    { "stencil", benchStencil },
+    { "blend", benchBlend },
+    { "oit", benchOIT },
+    { "lines", benchLines },
+    { "msaa", benchMultisample },
+    { "supersample", benchSupersample },
+    { "scissor", benchScissor },
+    { "redraw", benchRedraw },
+    { "targets", benchTargets },
+    { "lighting", benchLighting },
+    { "post", benchPost },
+    { "pipeline", benchPipeline },
+    { "ssao", benchSSAO },
+    { "tiled", benchTiled },
+};
+
+#define N_ELEMENTS(arr) (sizeof(arr)/sizeof(arr[0]))
+
+int main(int argc, char **argv)
+{
+    for (size_t i = 0; i < N_ELEMENTS(benches); i++) {
+        bool run = argc < 2;
+        for (int j = 1; j < argc; j++)
+            run |= !strcmp(argv[j], benches[i].name);
+        if (run)
+            benches[i].run();
+    }
+
+    return 0;
+}
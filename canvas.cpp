@@ -1,34 +1,125 @@
 #include <cstdio>
 #include <algorithm>
 #include <cassert>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "canvas.h"
 
+// xRGB8888
+static const PixelFormat frameFormat = {
+    4,
+    0xFF0000, 0x00FF00, 0x0000FF, 0,
+    16, 8, 0, 24,
+    0, 0, 0, 8
+};
+
+// Offsets from the pixel center in 1/16ths, the usual rotated patterns
+static const float pattern1[1][2] = { { 0, 0 } };
+static const float pattern2[2][2] = { { 4/16.f, 4/16.f }, { -4/16.f, -4/16.f } };
+static const float pattern4[4][2] = {
+    { -2/16.f, -6/16.f }, { 6/16.f, -2/16.f },
+    { -6/16.f, 2/16.f }, { 2/16.f, 6/16.f },
+};
+static const float pattern8[8][2] = {
+    { 1/16.f, -3/16.f }, { -1/16.f, 3/16.f },
+    { 5/16.f, 1/16.f }, { -3/16.f, -5/16.f },
+    { -5/16.f, 5/16.f }, { -7/16.f, -1/16.f },
+    { 3/16.f, 7/16.f }, { 7/16.f, -7/16.f },
+};
+
+const uint32_t Canvas::NO_FRAGMENT;
+
+Canvas::Canvas(Pixman &surf)
+    : m_surface(surf)
+    , m_frame(surf.width(), surf.height(), frameFormat)
+    , m_pixels((uint32_t*)m_frame.pixels())
+    , m_pitch(m_frame.stride()/sizeof(uint32_t))
+    , m_stride(m_pitch)
+    , m_zBufferSize(m_stride*m_frame.height())
+    , m_zBuffer(new int32_t[m_zBufferSize])
+    , m_texture(NULL)
+    , m_tiled(NULL)
+    , m_texFormat(TEX_NONE)
+    , m_filter(Texture::NEAREST)
+    , m_perspStep(16)
+    , m_color(m_frame.mapRGB(0xFF, 0x00, 0x00))
+    , m_alpha(0xFF)
+    , m_smooth(false)
+    , m_blend(REPLACE)
+    , m_depthWrite(true)
+    , m_span(surf.width())
+    , m_samples(1)
+    , m_sampleShift(0)
+    , m_pattern(pattern1)
+    , m_liveSlots(0)
+    , m_fragCount(0)
+    , m_fragOverflow(0)
+    , m_spanDepth(surf.width())
+{
+    m_fragStats.stored = m_fragStats.overflow = 0;
+    m_fragStats.longest = m_fragStats.bytes = 0;
+    m_stencil.enabled = m_stencil.dirty = false;
+    stencilFunc(ALWAYS, 0);
+    stencilOp(KEEP, KEEP, KEEP);
+    scissor();
+    m_targets[0] = &m_frame;
+    std::fill_n(m_targets+1, MAX_TARGETS-1, (Pixman*)NULL);
+    clear();
+}
+
+Canvas::~Canvas()
+{
+    delete [] m_zBuffer;
+}
+
 void Canvas::setColor(uint8_t r, uint8_t g, uint8_t b)
 {
-    m_color = m_surface.mapRGB(r, g, b);
+    m_color = m_frame.mapRGB(r, g, b);
 }
 
 void Canvas::plot(int x, int y, int z, uint32_t color)
 {
-    if (x < 0 || x >= m_surface.width() ||
-        y < 0 || y >= m_surface.height())
+    if (x < m_scissor.x0 || x > m_scissor.x1 ||
+        y < m_scissor.y0 || y > m_scissor.y1)
         return;
 
-    if (z <= m_zBuffer[y*m_surface.height()+x]) {
-        m_surface.set(x, y, color);
-        m_zBuffer[y*m_surface.height()+x] = z;
+    size_t i = (size_t)y*m_stride+x;
+    if (depthWord(z) <= m_zBuffer[i]) {
+        m_pixels[(size_t)y*m_pitch+x] = color;
+        m_zBuffer[i] = depthWord(z) | stencilOf(m_zBuffer[i]);
+        if (m_samples > 1)
+            dropSamples(i);
     }
 }
 
-void Canvas::point(int x, int y, int z)
+// Doesn't update z-buffer: partially covered pixels shouldn't occlude
+void Canvas::blendPlot(int x, int y, int z, uint8_t alpha)
 {
-    plot(x, y, z, m_color);
+    if (x < m_scissor.x0 || x > m_scissor.x1 ||
+        y < m_scissor.y0 || y > m_scissor.y1)
+        return;
+
+    size_t i = (size_t)y*m_stride+x;
+    if (depthWord(z) > m_zBuffer[i])
+        return;
+
+    // 0..256, full coverage is exactly the line color
+    uint32_t t = alpha + (alpha >> 7);
+    uint32_t *p = &m_pixels[(size_t)y*m_pitch+x];
+    *p = lerpRGB(*p, m_color, t) | (*p & 0xFF000000);
+    if (m_samples > 1 && m_sampleSlot[i]) {
+        uint32_t *sc = &m_sampleColor[(m_sampleSlot[i]-1)*m_samples];
+        for (int s = 0; s < m_samples; s++)
+            sc[s] = lerpRGB(sc[s], m_color, t);
+    }
 }
 
-static bool cmpY(const Vertex &a, const Vertex &b)
+void Canvas::point(int x, int y, int z)
 {
-    return a.y() < b.y();
+    touchTargets();
+    plot(x, y, z, m_color);
 }
 
 static bool cmpX(const Vertex &a, const Vertex &b)
@@ -38,6 +129,10 @@ static bool cmpX(const Vertex &a, const Vertex &b)
 
 void Canvas::line(const Vertex &a, const Vertex &b)
 {
+    touchTargets();
+    if (m_smooth)
+        return lineAA(a, b);
+
     Vertex v[2] = { a, b };
 
     if (a.y() == b.y()) {
@@ -46,7 +141,7 @@ void Canvas::line(const Vertex &a, const Vertex &b)
     }
 
     if (a.x() == b.x()) {
-        std::sort(v, v+2, cmpY);
+        std::sort(v, v+2, cmpY<Vertex>);
         return straightLineY(v[0].y(), v[1].y(), a.x());
     }
 
@@ -77,6 +172,48 @@ void Canvas::line(const Vertex &a, const Vertex &b)
     }
 }
 
+// Xiaolin Wu's line, y is stepped in 16.16 fixed point and the
+// fractional part gives coverage of the two pixels straddling the line
+void Canvas::lineAA(const Vertex &a, const Vertex &b)
+{
+    // Depth interpolated the way triangles do it
+    float x0 = a.x(), y0 = a.y(), z0 = m_perspStep ? 1/a.z() : a.z();
+    float x1 = b.x(), y1 = b.y(), z1 = m_perspStep ? 1/b.z() : b.z();
+
+    bool steep = fabs(y1 - y0) > fabs(x1 - x0);
+    if (steep) {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        std::swap(z0, z1);
+    }
+
+    float dx = x1 - x0;
+    float gradient = dx == 0 ? 0 : (y1 - y0)/dx;
+    float dz = dx == 0 ? 0 : (z1 - z0)/dx;
+    int xs = roundf(x0);
+    int xe = roundf(x1);
+    int32_t intery = (y0 + gradient*(xs - x0))*65536;
+    int32_t step = gradient*65536;
+
+    for (int x = xs; x <= xe; x++) {
+        int y = intery >> 16;
+        uint8_t f = (intery >> 8) & 0xFF;
+        int z = eyeZ(z0 + (x - x0)*dz)*DEPTH_SCALE;
+        if (steep) {
+            blendPlot(y, x, z, 255-f);
+            blendPlot(y+1, x, z, f);
+        } else {
+            blendPlot(x, y, z, 255-f);
+            blendPlot(x, y+1, z, f);
+        }
+        intery += step;
+    }
+}
+
 // FIXME The next two functions should use z-buffer too
 void Canvas::straightLineX(int x1, int x2, int y)
 {
@@ -90,104 +227,580 @@ void Canvas::straightLineY(int y1, int y2, int x)
         plot(x, y, 0, m_color);
 }
 
-// UP_DOWN - for flat bottom
-// DOWN_UP - for float top
-enum { UP_DOWN, DOWN_UP };
-
-void Canvas::scanlineTriangle(const Vertex vt[3], int dir)
-{
-    // Indeces specify requred order
-    static const int idx1[3] = { 0, 1, 2};
-    static const int idx2[3] = { 2, 0, 1};
-    const int *idx;
-    int l0, r0;
-
-    if (dir == UP_DOWN) {
-        idx = idx1;
-        l0 = r0 = 0;
-    } else {
-        idx = idx2;
-        l0 = 1;
-        r0 = 2;
-    }
-
-    float dy = vt[idx[2]].y() - vt[idx[0]].y();
-
-    // Prepare vectors for interpolation
-    vec4f v[3];
-    for (int i = 0; i < 3; i++) {
-        int j = idx[i];
-        v[i][0] = vt[j][0]; // x
-        v[i][1] = vt[j][3]; // u
-        v[i][2] = vt[j][4]; // v
-        v[i][3] = vt[j][2]; // z
-    }
-    if (v[1].x() > v[2].x())
-        std::swap(v[1][0], v[2][0]);
-
-    vec4f dvl = (v[1]-v[0])/dy; // Change in left line
-    vec4f dvr = (v[2]-v[0])/dy; // Change in right line
-    vec4f vl = v[l0];           // Left interpolant
-    vec4f vr = v[r0];           // Right interpolant
-
-    // Interpolate me baby!
-    for (int y = vt[0].y(); y <= vt[2].y(); y++) {
-        vec4f ddv = vr-vl;
-        // Change in uvz
-        vec3f duvz = vec3(ddv[1], ddv[2], ddv[3])/ddv.x();
-        vec3f uvz = vec3(vl[1], vl[2], vl[3]);
-        for (int x = vl.x(); x <= vr.x(); x++) {
-            int z = uvz[2]*100;
-            // FIXME: remove branch here
-            plot(x, y, z, m_texture ? m_texture->get(uvz[0], uvz[1]) : m_color);
-            uvz += duvz;
+// Untextured, every pixel gets the current color
+struct FlatShader : PixelShader {
+    enum { ATTRIBS = 0 };
+    uint32_t color;
+
+    FlatShader(uint32_t c) : color(c) {}
+    bool operator()(const float*, uint32_t &c) const
+    {
+        c = color;
+        return true;
+    }
+};
+
+// Textured shaders OR alpha into the top byte, zero unless blending
+template <typename F>
+struct TextureShader : PixelShader {
+    enum { ATTRIBS = 2 };
+    PixelView<F> view;
+    uint32_t alpha;
+
+    TextureShader(const Pixman &tex, uint32_t a) : view(tex), alpha(a) {}
+    bool operator()(const float *uv, uint32_t &c) const
+    {
+        // ARGB8888 matches too, its own alpha isn't ours
+        c = (view.get(uv[0], uv[1]) & 0xFFFFFF) | alpha;
+        return true;
+    }
+};
+
+// Mip level is picked per span from the uv derivatives
+template <int Filter>
+struct MipShader : PixelShader {
+    enum { ATTRIBS = 2 };
+    const Texture &tex;
+    int level;
+    uint32_t frac;              // Blend toward level+1, 0..256
+    uint32_t alpha;
+
+    MipShader(const Texture &t, uint32_t a)
+        : tex(t), level(0), frac(0), alpha(a) {}
+    void lod(const float*, const float *ddx, const float *ddy)
+    {
+        float l = tex.lod(ddx[0], ddx[1], ddy[0], ddy[1]);
+        if (Filter == Texture::TRILINEAR) {
+            level = l;
+            frac = (l-level)*256;
+        } else
+            level = l+0.5f;
+    }
+    bool operator()(const float *uv, uint32_t &c) const
+    {
+        if (Filter == Texture::NEAREST) {
+            c = tex.nearest(uv[0], uv[1], level) | alpha;
+            return true;
         }
-        vl += dvl;
-        vr += dvr;
+
+        c = tex.bilinear(uv[0], uv[1], level);
+        if (Filter == Texture::TRILINEAR && frac)
+            c = lerpRGB(c, tex.bilinear(uv[0], uv[1], level+1), frac);
+        c |= alpha;
+        return true;
+    }
+};
+
+// Textures in a format without compile-time variant
+struct PixmanShader : PixelShader {
+    enum { ATTRIBS = 2 };
+    const Pixman &tex;
+    uint32_t alpha;
+
+    PixmanShader(const Pixman &t, uint32_t a) : tex(t), alpha(a) {}
+    bool operator()(const float *uv, uint32_t &c) const
+    {
+        c = tex.unmapRGB(tex.get(uv[0], uv[1])) | alpha;
+        return true;
+    }
+};
+
+// Texture format is resolved here, not for every pixel
+void Canvas::triangle(const Vertex vs[3])
+{
+    uint32_t a = m_blend != REPLACE ? (uint32_t)m_alpha << 24 : 0;
+    switch (m_texFormat) {
+    case TEX_NONE:
+        fillTriangle(vs, FlatShader(m_color | a));
+        break;
+    case TEX_TILED:
+        if (m_filter == Texture::TRILINEAR)
+            fillTriangle(vs, MipShader<Texture::TRILINEAR>(*m_tiled, a));
+        else if (m_filter == Texture::BILINEAR)
+            fillTriangle(vs, MipShader<Texture::BILINEAR>(*m_tiled, a));
+        else
+            fillTriangle(vs, MipShader<Texture::NEAREST>(*m_tiled, a));
+        break;
+    case TEX_XRGB8888:
+        fillTriangle(vs, TextureShader<FormatXRGB8888>(*m_texture, a));
+        break;
+    case TEX_RGB888:
+        fillTriangle(vs, TextureShader<FormatRGB888>(*m_texture, a));
+        break;
+    case TEX_RGB565:
+        fillTriangle(vs, TextureShader<FormatRGB565>(*m_texture, a));
+        break;
+    default:
+        fillTriangle(vs, PixmanShader(*m_texture, a));
     }
 }
 
-static Vertex lerpY(const Vertex &a, const Vertex &b, int y)
+void Canvas::texture(const Texture *texture)
 {
-    Vertex d = b-a;
-    return a+(d/d.y())*(y-a.y());
+    m_texture = NULL;
+    m_tiled = texture;
+    m_texFormat = texture ? TEX_TILED : TEX_NONE;
 }
 
-void Canvas::triangle(const Vertex vs[3])
+void Canvas::texture(const Pixman *texture)
 {
-    Vertex vt[3];
-    std::copy(vs, vs+3, vt);
-    std::sort(vt, vt+3, cmpY);
+    m_texture = texture;
+    m_tiled = NULL;
+
+    if (!texture)
+        m_texFormat = TEX_NONE;
+    else if (FormatXRGB8888::match(texture->format()))
+        m_texFormat = TEX_XRGB8888;
+    else if (FormatRGB888::match(texture->format()))
+        m_texFormat = TEX_RGB888;
+    else if (FormatRGB565::match(texture->format()))
+        m_texFormat = TEX_RGB565;
+    else
+        m_texFormat = TEX_ANY;
+}
 
-    if (vt[0].y() == vt[2].y())
-        return;                 // Empty triangle
+void Canvas::target(Pixman *color, int index)
+{
+    assert(index >= 0 && index < MAX_TARGETS);
+    if (!color && index == 0)
+        color = &m_frame;
+    if (color) {
+        assert(color->width() == m_frame.width());
+        assert(color->height() == m_frame.height());
+        assert(color->format().bpp == 4);
+    }
 
-    if (vt[0].y() == vt[1].y())
-        scanlineTriangle(vt, DOWN_UP);
-    else if (vt[1].y() == vt[2].y())
-        scanlineTriangle(vt, UP_DOWN);
-    else {
-        // Make two "flat" triangles
-        Vertex vh[3];
+    m_targets[index] = color;
+    if (index == 0) {
+        m_pixels = (uint32_t*)color->pixels();
+        m_pitch = color->stride()/sizeof(uint32_t);
+    }
+}
 
-        int hy = vt[1].y();
-        Vertex h = lerpY(vt[0], vt[2], hy);
-        h[1] = hy;
+void Canvas::scissor(int x, int y, int w, int h)
+{
+    m_scissor.x0 = std::max(x, 0);
+    m_scissor.y0 = std::max(y, 0);
+    m_scissor.x1 = std::min(x+w, width()) - 1;
+    m_scissor.y1 = std::min(y+h, height()) - 1;
+}
 
-        vh[0] = vt[0];
-        vh[1] = vt[1];
-        vh[2] = h;
-        scanlineTriangle(vh, UP_DOWN);
+// All bound targets and the z-buffer, inside the scissor
+void Canvas::clear()
+{
+    const int x = m_scissor.x0, y = m_scissor.y0;
+    const int w = m_scissor.x1-x+1, h = m_scissor.y1-y+1;
+    if (w <= 0 || h <= 0)
+        return;
+    for (int i = 0; i < MAX_TARGETS; i++)
+        if (m_targets[i])
+            m_targets[i]->fill(x, y, w, h, 0);
 
-        vh[0] = h;
-        vh[1] = vt[1];
-        vh[2] = vt[2];
-        scanlineTriangle(vh, DOWN_UP);
+    dropScissored();
+    if (scissored()) {
+        for (int r = y; r < y+h; r++)
+            std::fill_n(m_zBuffer + (size_t)r*m_stride + x, w,
+                        depthWord(DEPTH_FAR));
+        return;
     }
+    std::fill_n(m_zBuffer, m_zBufferSize, depthWord(DEPTH_FAR));
+    m_stencil.dirty = m_stencil.enabled;
 }
 
-void Canvas::clear()
+// Samples and fragment lists inside the scissor. Scissored, the
+// fragment arena isn't reused until a full clear.
+void Canvas::dropScissored()
+{
+    if (!scissored()) {
+        dropFragments();
+        dropAllSamples();
+        return;
+    }
+
+    const int x = m_scissor.x0, w = m_scissor.x1-x+1;
+    if (m_fragCount)
+        for (int r = m_scissor.y0; r <= m_scissor.y1; r++)
+            std::fill_n(&m_fragHead[(size_t)r*m_stride + x], w, NO_FRAGMENT);
+    for (size_t k = 0; k < m_slotPixel.size(); k++)
+        if (m_slotPixel[k] != NO_PIXEL && inScissor(m_slotPixel[k]))
+            dropSamples(m_slotPixel[k]);
+}
+
+void Canvas::save(Layer &layer)
 {
-    m_surface.clear();
-    std::fill_n(m_zBuffer, m_zBufferSize, nl32::max());
+    const int w = width(), h = height();
+    resolve();
+    layer.color.resize((size_t)w*h);
+    for (int y = 0; y < h; y++)
+        std::copy(m_pixels + (size_t)y*m_pitch, m_pixels + (size_t)y*m_pitch + w,
+                  &layer.color[(size_t)y*w]);
+    layer.depth.assign(m_zBuffer, m_zBuffer + m_zBufferSize);
+    layer.stencil = m_stencil.dirty;
+}
+
+// Like clear(), with the layer instead of black and far
+void Canvas::restore(const Layer &layer)
+{
+    const int x = m_scissor.x0, w = m_scissor.x1-x+1;
+    assert(layer.color.size() == (size_t)width()*height());
+    assert(layer.depth.size() == m_zBufferSize);
+    if (w <= 0 || m_scissor.y1 < m_scissor.y0)
+        return;
+
+    dropScissored();
+    touchTargets();
+    for (int y = m_scissor.y0; y <= m_scissor.y1; y++) {
+        const uint32_t *c = &layer.color[(size_t)y*width() + x];
+        std::copy(c, c + w, m_pixels + (size_t)y*m_pitch + x);
+        const int32_t *z = &layer.depth[(size_t)y*m_stride + x];
+        std::copy(z, z + w, m_zBuffer + (size_t)y*m_stride + x);
+    }
+    if (!scissored())
+        m_stencil.dirty = m_stencil.enabled;
+    m_stencil.dirty |= layer.stencil;
+}
+
+// Samples keep their colors. Without a stencil to keep a plain fill
+// does, it is much cheaper than rewriting every word.
+void Canvas::clearDepth()
+{
+    const int x = m_scissor.x0, w = m_scissor.x1-x+1;
+    for (int y = m_scissor.y0; y <= m_scissor.y1; y++) {
+        int32_t *z = m_zBuffer + (size_t)y*m_stride + x;
+        if (m_stencil.dirty) {
+            for (int i = 0; i < w; i++)
+                z[i] = depthWord(DEPTH_FAR) | stencilOf(z[i]);
+        } else
+            std::fill_n(z, w, depthWord(DEPTH_FAR));
+    }
+
+    if (!scissored()) {
+        std::fill(m_sampleDepth.begin(), m_sampleDepth.end(), nl32::max());
+        return;
+    }
+    for (size_t k = 0; k < m_slotPixel.size(); k++)
+        if (m_slotPixel[k] != NO_PIXEL && inScissor(m_slotPixel[k]))
+            std::fill_n(&m_sampleDepth[k*m_samples], m_samples, nl32::max());
+}
+
+void Canvas::clearStencil(uint8_t s)
+{
+    const int x = m_scissor.x0, w = m_scissor.x1-x+1;
+    for (int y = m_scissor.y0; y <= m_scissor.y1; y++) {
+        int32_t *z = m_zBuffer + (size_t)y*m_stride + x;
+        for (int i = 0; i < w; i++)
+            z[i] = (z[i] & ~STENCIL_MASK) | s;
+    }
+    if (!scissored())
+        m_stencil.dirty = false;
+    m_stencil.dirty |= s || m_stencil.enabled;
+}
+
+void Canvas::multisample(int samples)
+{
+    switch (samples) {
+    case 1:
+        m_pattern = pattern1;
+        break;
+    case 2:
+        m_pattern = pattern2;
+        break;
+    case 4:
+        m_pattern = pattern4;
+        break;
+    case 8:
+        m_pattern = pattern8;
+        break;
+    default:
+        assert(!"2, 4 or 8 samples");
+        return;
+    }
+
+    clear();
+    m_samples = samples;
+    for (m_sampleShift = 0; 1 << m_sampleShift < samples; m_sampleShift++)
+        ;
+    if (samples > 1)
+        m_sampleSlot.assign(m_zBufferSize, 0);
+    else
+        std::vector<uint32_t>().swap(m_sampleSlot);
+}
+
+// Only the pixels that had slots are touched
+void Canvas::dropAllSamples()
+{
+    for (size_t k = 0; k < m_slotPixel.size(); k++)
+        if (m_slotPixel[k] != NO_PIXEL)
+            m_sampleSlot[m_slotPixel[k]] = 0;
+    m_sampleColor.clear();
+    m_sampleDepth.clear();
+    m_slotPixel.clear();
+    m_freeSlots.clear();
+    m_liveSlots = 0;
+}
+
+// Edge pixel starts out with all samples as the whole pixel was. Slots
+// of pixels covered whole since are taken first, so storage follows
+// the edges alive at once rather than all the frame touched.
+uint32_t Canvas::newSlot(size_t pixel, uint32_t color, int32_t z)
+{
+    m_liveSlots++;
+    if (!m_freeSlots.empty()) {
+        uint32_t k = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        std::fill_n(&m_sampleColor[(size_t)k*m_samples], m_samples, color);
+        std::fill_n(&m_sampleDepth[(size_t)k*m_samples], m_samples, z);
+        m_slotPixel[k] = pixel;
+        return m_sampleSlot[pixel] = k+1;
+    }
+
+    m_sampleColor.insert(m_sampleColor.end(), m_samples, color);
+    m_sampleDepth.insert(m_sampleDepth.end(), m_samples, z);
+    m_slotPixel.push_back(pixel);
+    return m_sampleSlot[pixel] = m_slotPixel.size();
+}
+
+// Box filter, channels summed two at a time like lerpRGB() does. 8 sums
+// of 8 bits fit in the 8 bits of space between red and blue. Resolved
+// pixels are whole again, so a second resolve() changes nothing.
+// Transparent fragments go over the result.
+void Canvas::resolve()
+{
+    const int S = m_samples;
+    const uint32_t round = (S >> 1)*0x010101;
+
+    if (m_liveSlots || m_fragCount || m_fragOverflow)
+        touchTargets();
+    for (size_t k = 0; k < m_slotPixel.size(); k++) {
+        size_t p = m_slotPixel[k];
+        if (p == NO_PIXEL)
+            continue;
+
+        const uint32_t *sc = &m_sampleColor[k*S];
+        uint32_t rb = round & 0xFF00FF, g = round & 0xFF00;
+        for (int s = 0; s < S; s++) {
+            rb += sc[s] & 0xFF00FF;
+            g += sc[s] & 0xFF00;
+        }
+        size_t y = p/m_stride, x = p%m_stride;
+        m_pixels[y*m_pitch + x] = (rb >> m_sampleShift & 0xFF00FF)
+            | (g >> m_sampleShift & 0xFF00);
+    }
+    dropAllSamples();
+    resolveFragments();
+}
+
+void Canvas::orderIndependent(size_t budget)
+{
+    assert(budget < NO_FRAGMENT);
+    clear();
+    std::vector<Fragment>(budget).swap(m_fragments);
+    if (budget)
+        m_fragHead.assign(m_zBufferSize, NO_FRAGMENT);
+    else
+        std::vector<uint32_t>().swap(m_fragHead);
+    m_fragStats.bytes = m_fragments.size()*sizeof(Fragment)
+        + m_fragHead.size()*sizeof(uint32_t);
+}
+
+// Pixels of m_span that were drawn, m_spanDepth tells them apart
+void Canvas::appendFragments(int y, int x, int xe)
+{
+    uint32_t *head = &m_fragHead[(size_t)y*m_stride];
+    uint32_t *row = m_pixels + (size_t)y*m_pitch;
+    const uint32_t *color = &m_span[0];
+    const int32_t *z = &m_spanDepth[0];
+
+    for (; x <= xe; x++) {
+        if (z[x] == nl32::max())
+            continue;
+        if (m_fragCount == m_fragments.size()) {
+            row[x] = blendRGB(row[x], color[x], m_blend);
+            m_fragOverflow++;
+            continue;
+        }
+        Fragment &f = m_fragments[m_fragCount];
+        f.depth = depthOf(z[x]);
+        f.color = color[x];
+        f.next = head[x];
+        f.blend = m_blend;
+        head[x] = m_fragCount++;
+    }
+}
+
+// Lists are short, an insertion sort far to near is all it takes. Ties
+// keep draw order. Fragments behind opaque pixels drawn after them are
+// left out.
+void Canvas::resolveFragments()
+{
+    if (!m_fragCount && !m_fragOverflow)
+        return;
+
+    const int w = width(), h = height();
+    size_t longest = 0;
+
+#pragma omp parallel reduction(max: longest)
+    {
+        std::vector<Fragment> list;
+#pragma omp for schedule(dynamic, 8)
+        for (int y = 0; y < h; y++) {
+            uint32_t *head = &m_fragHead[(size_t)y*m_stride];
+            const int32_t *zrow = depth(y);
+            uint32_t *row = m_pixels + (size_t)y*m_pitch;
+            for (int x = 0; x < w; x++) {
+                if (head[x] == NO_FRAGMENT)
+                    continue;
+
+                // Newest first, reversed into draw order
+                list.clear();
+                for (uint32_t i = head[x]; i != NO_FRAGMENT; i = m_fragments[i].next)
+                    if (m_fragments[i].depth <= depthOf(zrow[x]))
+                        list.push_back(m_fragments[i]);
+                head[x] = NO_FRAGMENT;
+                std::reverse(list.begin(), list.end());
+                longest = std::max(longest, list.size());
+
+                for (size_t i = 1; i < list.size(); i++) {
+                    Fragment f = list[i];
+                    size_t j = i;
+                    for (; j > 0 && list[j-1].depth < f.depth; j--)
+                        list[j] = list[j-1];
+                    list[j] = f;
+                }
+
+                uint32_t c = row[x];
+                for (size_t i = 0; i < list.size(); i++)
+                    c = blendRGB(c, list[i].color, (Blend)list[i].blend);
+                row[x] = c;
+            }
+        }
+    }
+
+    m_fragStats.stored = m_fragCount;
+    m_fragStats.overflow = m_fragOverflow;
+    m_fragStats.longest = longest;
+    m_fragCount = m_fragOverflow = 0;
+}
+
+// Unresolved lists are forgotten
+void Canvas::dropFragments()
+{
+    if (m_fragCount)
+        std::fill(m_fragHead.begin(), m_fragHead.end(), NO_FRAGMENT);
+    m_fragCount = m_fragOverflow = 0;
+}
+
+// Same z as the shaded path of scanlineTriangle, 4 pixels at a time
+void Canvas::depthSpan(int32_t *zbuf, int x0, int x, int xe,
+                       float z0, float dz)
+{
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(DEPTH_SCALE);
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 vz0 = _mm_set1_ps(z0);
+    const __m128 vdz = _mm_set1_ps(dz);
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i smask = _mm_set1_epi32(STENCIL_MASK);
+
+    for (; x+3 <= xe; x += 4) {
+        __m128i off = _mm_add_epi32(_mm_set1_epi32(x-x0), lanes);
+        __m128 z = _mm_add_ps(vz0, _mm_mul_ps(_mm_cvtepi32_ps(off), vdz));
+        if (m_perspStep)
+            z = _mm_div_ps(one, z);
+        __m128i zw = _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(z, scale)), 8);
+        __m128i old = _mm_loadu_si128((__m128i*)(zbuf+x));
+        // Nearer depth over the old stencil, SSE2 has no signed 32-bit min
+        __m128i behind = _mm_cmpgt_epi32(zw, old);
+        zw = _mm_or_si128(zw, _mm_and_si128(old, smask));
+        __m128i res = _mm_or_si128(_mm_and_si128(behind, old),
+                                   _mm_andnot_si128(behind, zw));
+        _mm_storeu_si128((__m128i*)(zbuf+x), res);
+    }
+#endif
+    for (; x <= xe; x++) {
+        int32_t zw = depthAt(z0 + (x-x0)*dz);
+        if (zw < zbuf[x])
+            zbuf[x] = zw | stencilOf(zbuf[x]);
+    }
+}
+
+// Depth only with the stencil, for masks and stencil only passes
+void Canvas::stencilDepthSpan(int32_t *zbuf, int x0, int x, int xe,
+                              float z0, float dz)
+{
+    for (; x <= xe; x++) {
+        int32_t zw = depthAt(z0 + (x-x0)*dz);
+        if (!stencilTest(zbuf[x], zw <= zbuf[x]))
+            continue;
+        zbuf[x] = applyStencil(m_stencil.zpass, zbuf[x]);
+        if (m_depthWrite)
+            zbuf[x] = zw | stencilOf(zbuf[x]);
+    }
+}
+
+// Same as blendRGB() per pixel, 4 at a time with channels widened to 16
+// bits: 2 pixels per register half
+void blendSpan(uint32_t *dst, const uint32_t *src, int n, Canvas::Blend mode)
+{
+    if (mode == Canvas::REPLACE) {
+        std::copy(src, src + n, dst);
+        return;
+    }
+
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb = _mm_set1_epi32(0xFFFFFF);
+    const __m128i w256 = _mm_set1_epi16(256);
+
+    for (; x+4 <= n; x += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src+x));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst+x));
+        __m128i res[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i sw = h ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+            __m128i dw = h ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+            // Alpha into all 4 words of its pixel, 0..256
+            __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sw, 0xFF), 0xFF);
+            a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+            __m128i ia = _mm_sub_epi16(w256, a);
+            switch (mode) {
+            case Canvas::ALPHA:
+                // Weights add up to 256, the sum fits 16 bits unsigned
+                res[h] = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dw, ia),
+                                                      _mm_mullo_epi16(sw, a)), 8);
+                break;
+            case Canvas::ADDITIVE:
+                res[h] = _mm_srli_epi16(_mm_mullo_epi16(sw, a), 8);
+                break;
+            default:
+                res[h] = _mm_srli_epi16(_mm_mullo_epi16(dw, ia), 8);
+            }
+        }
+        __m128i r = _mm_packus_epi16(res[0], res[1]);
+        if (mode == Canvas::ADDITIVE)
+            r = _mm_adds_epu8(d, r);
+        else if (mode == Canvas::PREMULTIPLIED)
+            r = _mm_adds_epu8(r, _mm_and_si128(s, rgb));
+        _mm_storeu_si128((__m128i*)(dst+x), _mm_and_si128(r, rgb));
+    }
+#endif
+    for (; x < n; x++)
+        dst[x] = blendRGB(dst[x], src[x], mode);
+}
+
+void Canvas::present()
+{
+    resolve();
+    m_frame.convert(m_surface);
+}
+
+void Canvas::present(const Rect &r)
+{
+    resolve();
+    int x = std::max(r.x0, 0), y = std::max(r.y0, 0);
+    int w = std::min(r.x1+1, width()) - x, h = std::min(r.y1+1, height()) - y;
+    if (w <= 0 || h <= 0)
+        return;
+    m_frame.convert(m_surface, x, y, w, h);
 }
@@ -2,45 +2,514 @@
 #define CANVAS_H
 
 #include <limits>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
 #include "pixman.h"
+#include "texture.h"
 #include "vec.h"
 
 typedef std::numeric_limits<int32_t> nl32;
 
-// (x, t, z, u, v)
-typedef vec<5, float> Vertex;
+// (x, y, z, attributes...), z is w
+template <size_t N>
+using VertexN = vec<3+N, float>;
 
-struct Material {
-    vec4f ambient;
-    vec4f diffuse;
-    vec4f specular;
+// (x, y, z, u, v)
+typedef VertexN<2> Vertex;
+
+// (x, y, z, 1/w, attributes/w...), linear in screen space
+template <size_t N>
+using ScreenVertex = vec<4+N, float>;
+
+// Base for pixel shaders. A shader is a functor with
+//
+//   enum { ATTRIBS = n };
+//   bool operator()(const float *attr, uint32_t &color);
+//
+// called for every pixel passing the depth test with the n interpolated
+// attributes, it returns false to discard the pixel. Only n attributes
+// are interpolated, so a shader may be used with richer vertices.
+// lod() is called once per span with the attributes at its start and
+// their derivatives along x and y.
+//
+// A shader with OUTPUTS > 1 writes that many colors at once, one per
+// bound target, with
+//
+//   bool operator()(const float *attr, uint32_t *colors);
+struct PixelShader {
+    enum { OUTPUTS = 1 };
+    void lod(const float*, const float*, const float*) {}
+};
+
+template <typename Shader>
+inline bool shadePixel(Shader &shader, const float *a, uint32_t *c,
+                       std::true_type)
+{
+    return shader(a, c[0]);
+}
+
+template <typename Shader>
+inline bool shadePixel(Shader &shader, const float *a, uint32_t *c,
+                       std::false_type)
+{
+    return shader(a, c);
+}
+
+// Lambda as a shader: shader<2>([](const float *uv, uint32_t &c) {...})
+template <size_t N, typename F>
+struct LambdaShader : PixelShader {
+    enum { ATTRIBS = N };
+    F f;
+
+    LambdaShader(const F &f) : f(f) {}
+    bool operator()(const float *attr, uint32_t &color)
+    {
+        return f(attr, color);
+    }
+};
+
+template <size_t N, typename F>
+LambdaShader<N, F> shader(const F &f)
+{
+    return LambdaShader<N, F>(f);
+}
+
+// Marks the depth only path of Canvas::depthTriangle(), never called
+struct DepthOnly : PixelShader {
+    enum { ATTRIBS = 0 };
+    bool operator()(const float*, uint32_t&) const
+    {
+        return false;
+    }
+};
+
+template <typename Shader>
+struct IsDepthOnly {
+    enum { value = 0 };
+};
+
+template <>
+struct IsDepthOnly<DepthOnly> {
+    enum { value = 1 };
 };
 
 class Canvas {
-    Pixman &m_surface;
+public:
+    enum { MAX_TARGETS = 4 };
+    // How colors of triangles are combined with target 0, the top byte
+    // of a shader's color is the source alpha when blending.
+    //   REPLACE        d = s
+    //   ALPHA          d = s*a + d*(1-a)
+    //   ADDITIVE       d = s*a + d, saturated
+    //   PREMULTIPLIED  d = s + d*(1-a), s already multiplied by alpha
+    enum Blend { REPLACE, ALPHA, ADDITIVE, PREMULTIPLIED };
+    // Stencil test, (ref & mask) func (stencil & mask)
+    enum Compare { NEVER, LESS, LEQUAL, GREATER, GEQUAL, EQUAL, NOTEQUAL, ALWAYS };
+    // Stencil update, REF writes the reference value. Plain INCR and
+    // DECR saturate, the _WRAP ones wrap around.
+    enum StencilOp { KEEP, ZERO, REF, INCR, DECR, INVERT, INCR_WRAP, DECR_WRAP };
+    static const uint32_t NO_FRAGMENT = ~(uint32_t)0;
+
+    // Fragment memory at the last resolve() that had any
+    struct FragmentStats {
+        size_t stored;          // Sorted and composited
+        size_t overflow;        // Past the budget
+        size_t longest;         // Fragments of the deepest pixel
+        size_t bytes;           // Arena and list heads, fixed
+    };
+
+    // Pixels x0..x1 by y0..y1, empty when either range is
+    struct Rect {
+        int x0, y0;             // First pixel inside
+        int x1, y1;             // Last pixel inside
+
+        bool empty() const
+        {
+            return x0 > x1 || y0 > y1;
+        }
+        int area() const
+        {
+            return empty() ? 0 : (x1-x0+1)*(y1-y0+1);
+        }
+        // Smallest rectangle around both
+        Rect join(const Rect &r) const
+        {
+            if (empty())
+                return r;
+            if (r.empty())
+                return *this;
+            Rect u = { std::min(x0, r.x0), std::min(y0, r.y0),
+                       std::max(x1, r.x1), std::max(y1, r.y1) };
+            return u;
+        }
+    };
+
+    // The resolved frame and z-buffer, see save()
+    struct Layer {
+        std::vector<uint32_t> color;
+        std::vector<int32_t> depth; // Stencil included
+        bool stencil;
+    };
+private:
+    Pixman &m_surface;          // Presentation surface
+    Pixman m_frame;             // 32-bit frame we actually render into
+    Pixman *m_targets[MAX_TARGETS]; // Color outputs, 0 is m_frame if unset
+    uint32_t *m_pixels;         // Of target 0
+    size_t m_pitch;             // Row length of target 0
+    size_t m_stride;            // Row length of z-buffer
     size_t m_zBufferSize;
     int32_t *m_zBuffer;
     const Pixman *m_texture;
+    const Texture *m_tiled;
+    enum {
+        TEX_NONE, TEX_TILED, TEX_XRGB8888, TEX_RGB888, TEX_RGB565, TEX_ANY
+    } m_texFormat;
+    Texture::Filter m_filter;
+    int m_perspStep;
     uint32_t m_color;
+    uint8_t m_alpha;            // Of the built-in shaders when blending
+    bool m_smooth;
+    Blend m_blend;
+    bool m_depthWrite;
+    std::vector<uint32_t> m_span; // Shaded span waiting to be blended
+    Rect m_scissor;
 
-    void scanlineTriangle(const Vertex v[3], int dir);
-public:
-    Canvas(Pixman &surf)
-        : m_surface(surf)
-        , m_zBufferSize(m_surface.width()*m_surface.height())
-        , m_zBuffer(new int32_t[m_zBufferSize])
-        , m_texture(NULL)
-        , m_color(m_surface.mapRGB(0xFF, 0x00, 0x00))
+    // Multisampling. A pixel covered whole by its last triangle keeps
+    // one color in the target and one depth in the z-buffer, like
+    // without it. Only pixels on edges get a slot with a color and a
+    // depth per sample, so memory traffic follows the edges rather
+    // than the sample count.
+    int m_samples;              // Per pixel, 1 is off
+    int m_sampleShift;          // log2(m_samples)
+    const float (*m_pattern)[2]; // Sample offsets from the pixel center
+    std::vector<uint32_t> m_sampleSlot;  // Per pixel, 0 or slot+1
+    std::vector<uint32_t> m_sampleColor; // m_samples per slot
+    std::vector<int32_t> m_sampleDepth;  // Depth alone, no stencil
+    std::vector<size_t> m_slotPixel;     // z-buffer index, NO_PIXEL if freed
+    std::vector<uint32_t> m_freeSlots;   // Freed, reused before growing
+    size_t m_liveSlots;
+
+    // Order independent transparency. Blended pixels become fragments
+    // in per pixel lists, newest first, allocated from an arena sized
+    // up front. resolve() sorts every list and composites it far to near.
+    struct Fragment {
+        int32_t depth;
+        uint32_t color;
+        uint32_t next;          // Arena index, NO_FRAGMENT ends the list
+        uint8_t blend;
+    };
+    std::vector<Fragment> m_fragments; // Arena, empty is off
+    std::vector<uint32_t> m_fragHead;  // Per pixel, like the z-buffer
+    size_t m_fragCount;         // Arena entries in use
+    size_t m_fragOverflow;      // Blended unsorted, the arena was full
+    std::vector<int32_t> m_spanDepth; // Of m_span, nl32::max() not drawn
+    FragmentStats m_fragStats;
+
+    struct {
+        bool enabled;
+        bool dirty;             // Some pixel may have a stencil but 0
+        Compare func;
+        uint8_t ref, mask;
+        uint8_t writeMask;
+        StencilOp fail, zfail, zpass;
+    } m_stencil;
+
+    // UP_DOWN - for flat bottom
+    // DOWN_UP - for float top
+    enum { UP_DOWN, DOWN_UP };
+    // What the rasterizer does with the stencil bits of the z-buffer:
+    // all zero, kept through depth writes, or tested and updated
+    enum { STENCIL_ZERO, STENCIL_KEEP, STENCIL_TEST };
+
+    template <typename Shader, typename Stencil>
+    void scanlineTriangle(const ScreenVertex<Shader::ATTRIBS> v[3],
+                          int dir, Shader shader, Stencil);
+    template <size_t M, typename Shader>
+    void fillTriangle(const vec<M, float> vs[3], const Shader &shader);
+    template <size_t M, typename Shader>
+    void sampledTriangle(const vec<M, float> vs[3], Shader shader);
+    uint32_t newSlot(size_t pixel, uint32_t color, int32_t z);
+    void dropAllSamples();
+    // Drawing writes targets through their pixels(), textures bound as
+    // targets have to change version once per draw
+    void touchTargets()
+    {
+        for (int o = 0; o < MAX_TARGETS; o++)
+            if (m_targets[o])
+                m_targets[o]->touch();
+    }
+    bool inScissor(size_t pixel) const
+    {
+        int y = pixel/m_stride, x = pixel%m_stride;
+        return x >= m_scissor.x0 && x <= m_scissor.x1
+            && y >= m_scissor.y0 && y <= m_scissor.y1;
+    }
+    void dropSamples(size_t pixel)
+    {
+        if (uint32_t slot = m_sampleSlot[pixel]) {
+            m_slotPixel[slot-1] = NO_PIXEL;
+            m_freeSlots.push_back(slot-1);
+            m_sampleSlot[pixel] = 0;
+            m_liveSlots--;
+        }
+    }
+    // Eye z of an interpolated depth. Under perspective() triangles
+    // interpolate 1/z, which is linear on screen where z isn't.
+    float eyeZ(float z) const
+    {
+        return m_perspStep ? 1/z : z;
+    }
+    int32_t depthAt(float z) const
+    {
+        return depthWord(eyeZ(z)*DEPTH_SCALE);
+    }
+    // Pixels x..xe of a span whose depth is z0 at x0
+    void depthSpan(int32_t *zbuf, int x0, int x, int xe, float z0, float dz);
+    void stencilDepthSpan(int32_t *zbuf, int x0, int x, int xe,
+                          float z0, float dz);
+    // Stencil of z-buffer word after op, only the write mask bits change
+    int32_t applyStencil(StencilOp op, int32_t word) const
+    {
+        uint32_t s = word & STENCIL_MASK, r;
+        switch (op) {
+        case ZERO:      r = 0; break;
+        case REF:       r = m_stencil.ref; break;
+        case INCR:      r = s < STENCIL_MASK ? s+1 : s; break;
+        case DECR:      r = s > 0 ? s-1 : s; break;
+        case INVERT:    r = ~s; break;
+        case INCR_WRAP: r = s+1; break;
+        case DECR_WRAP: r = s-1; break;
+        default:        return word;
+        }
+        uint32_t m = m_stencil.writeMask;
+        return (word & ~(int32_t)m) | (r & m);
+    }
+    // Stencil then depth test of a pixel. Failing pixels get their
+    // stencil op here, the caller applies zpass once the pixel is drawn.
+    bool stencilTest(int32_t &word, bool depthPass) const
     {
-        clear();
+        uint32_t s = word & m_stencil.mask, r = m_stencil.ref & m_stencil.mask;
+        bool pass;
+        switch (m_stencil.func) {
+        case NEVER:     pass = false; break;
+        case LESS:      pass = r < s; break;
+        case LEQUAL:    pass = r <= s; break;
+        case GREATER:   pass = r > s; break;
+        case GEQUAL:    pass = r >= s; break;
+        case EQUAL:     pass = r == s; break;
+        case NOTEQUAL:  pass = r != s; break;
+        default:        pass = true;
+        }
+        if (!pass)
+            word = applyStencil(m_stencil.fail, word);
+        else if (!depthPass)
+            word = applyStencil(m_stencil.zfail, word);
+        return pass && depthPass;
     }
+    void appendFragments(int y, int x, int xe);
+    void resolveFragments();
+    void dropFragments();
+    void dropScissored();
+    void blendPlot(int x, int y, int z, uint8_t alpha);
+    void lineAA(const Vertex &a, const Vertex &b);
+public:
+    // z-buffer words hold the depth, z*DEPTH_SCALE, in their upper 24
+    // bits over the stencil in the lower 8, so |z| < 2^23/DEPTH_SCALE.
+    // DEPTH_FAR is where nothing was drawn.
+    enum { DEPTH_SCALE = 100, DEPTH_FAR = 0x7FFFFF, STENCIL_MASK = 0xFF };
+    enum { MAX_SAMPLES = 8 };
+    static const size_t NO_PIXEL = ~(size_t)0;
+
+    Canvas(Pixman &surf);
+    ~Canvas();
 
+    // Colors, depth and stencil. Clears only the scissor rectangle.
     void clear();
+    // Depth alone, the stencil stays
+    void clearDepth();
+    void clearStencil(uint8_t s = 0);
+
+    // Keep what was drawn so far, resolved, to start later frames from
+    // with restore() instead of clear(). Target 0 only, the restored
+    // pixels aren't multisampled. restore() stays in the scissor.
+    void save(Layer &layer);
+    void restore(const Layer &layer);
+
+    // Drawing and clearing stay inside w x h at (x, y), clamped to the
+    // canvas. Triangles clamp their rows and spans to it, not pixels,
+    // and skip it whole when their bounds miss it.
+    void scissor(int x, int y, int w, int h);
+    void scissor(const Rect &r)
+    {
+        scissor(r.x0, r.y0, r.x1-r.x0+1, r.y1-r.y0+1);
+    }
+    // All of the canvas
+    void scissor()
+    {
+        scissor(0, 0, width(), height());
+    }
+    const Rect& scissorRect() const
+    {
+        return m_scissor;
+    }
+    bool scissored() const
+    {
+        return m_scissor.x0 > 0 || m_scissor.y0 > 0
+            || m_scissor.x1 < width()-1 || m_scissor.y1 < height()-1;
+    }
+    // Convert the frame into the presentation surface, resolves first
+    void present();
+    // Only r of it, for partial redraws
+    void present(const Rect &r);
+
+    // Anti-aliased triangles with 2, 4 or 8 samples per pixel, 1 turns
+    // it off. Depth is tested per sample, shaders still run once per
+    // pixel and triangle, at the center or at a covered sample on
+    // edges. Only target 0 is
+    // multisampled, depthTriangle() and lines are per pixel. Clears the
+    // canvas.
+    void multisample(int samples);
+    int samples() const
+    {
+        return m_samples;
+    }
+    // Average the samples of edge pixels into target 0 and make them
+    // whole pixels, then composite the fragments of orderIndependent().
+    // For passes reading the frame before present().
+    void resolve();
+    // Pixels holding separate samples
+    size_t sampledPixels() const
+    {
+        return m_liveSlots;
+    }
+    // Slots in storage, freed ones waiting for reuse included
+    size_t sampleSlots() const
+    {
+        return m_slotPixel.size();
+    }
+
+    // Blended triangles store up to budget fragments instead of blending
+    // in draw order, resolve() composites them sorted by depth. Past the
+    // budget they blend right away. Per pixel, also when multisampling.
+    // 0 turns it off. Clears the canvas.
+    void orderIndependent(size_t budget);
+    bool orderIndependent() const
+    {
+        return !m_fragments.empty();
+    }
+    const FragmentStats& fragmentStats() const
+    {
+        return m_fragStats;
+    }
+
+    // Frame being rendered, target 0. Take view()s of it to work on tiles
+    Pixman& frame()
+    {
+        return *m_targets[0];
+    }
+
+    // Render into another xRGB8888 Pixman of the canvas size, NULL is
+    // the own frame for index 0 and nothing for the others. Targets
+    // past 0 take the extra colors of shaders with OUTPUTS > 1. A
+    // target can be bound as texture for the next pass, not this one.
+    void target(Pixman *color, int index = 0);
+
+    // Row of the z-buffer, depth and stencil packed, see depthOf()
+    const int32_t* depth(int y) const
+    {
+        return m_zBuffer + (size_t)y*m_stride;
+    }
+    static int32_t depthOf(int32_t word)
+    {
+        return word >> 8;
+    }
+    static uint8_t stencilOf(int32_t word)
+    {
+        return word & STENCIL_MASK;
+    }
+    // Word of depth d and stencil 0. Compares against whole words as d
+    // against their depthOf(), a pixel of equal depth passes.
+    static int32_t depthWord(int32_t d)
+    {
+        return d*256;
+    }
+
+    // Format of the frame, textures should use it too
+    const PixelFormat& format() const
+    {
+        return m_frame.format();
+    }
 
     void setColor(uint8_t r, uint8_t g, uint8_t b);
-    void texture(const Pixman *texture)
+    void texture(const Pixman *texture);
+    void texture(const Texture *texture);
+    // Sampling of Texture, Pixman textures are always nearest
+    void filter(Texture::Filter f)
     {
-        m_texture = texture;
+        m_filter = f;
+    }
+
+    // Perspective correct texture mapping, u and v are exact every step
+    // pixels and interpolated linearly between. Depth is exact at every
+    // pixel. 0 is plain affine, depth too, which is right for
+    // orthographic views.
+    void perspective(int step)
+    {
+        m_perspStep = step;
+    }
+
+    // Anti-aliased lines, coverage is blended into the surface
+    void smoothLines(bool enable)
+    {
+        m_smooth = enable;
+    }
+
+    // Triangles only, lines and points always replace
+    void blend(Blend mode)
+    {
+        m_blend = mode;
+    }
+    Blend blend() const
+    {
+        return m_blend;
+    }
+    // Opacity of setColor() and textures when blending
+    void alpha(uint8_t a)
+    {
+        m_alpha = a;
+    }
+    // Triangles still test depth without it, for transparent surfaces
+    // over opaque ones
+    void depthWrite(bool enable)
+    {
+        m_depthWrite = enable;
+    }
+
+    // Stencil test and update for triangles, depthTriangle() too. Lines,
+    // points and multisampled triangles ignore it. The stencil lives in
+    // the z-buffer words, one load tests both.
+    void stencil(bool enable)
+    {
+        m_stencil.enabled = enable;
+        m_stencil.dirty |= enable;
+    }
+    void stencilFunc(Compare func, uint8_t ref, uint8_t mask = 0xFF)
+    {
+        m_stencil.func = func;
+        m_stencil.ref = ref;
+        m_stencil.mask = mask;
+    }
+    // For pixels failing the stencil test, failing the depth test, and
+    // drawn. Only writeMask bits change.
+    void stencilOp(StencilOp fail, StencilOp zfail, StencilOp zpass,
+                   uint8_t writeMask = 0xFF)
+    {
+        m_stencil.fail = fail;
+        m_stencil.zfail = zfail;
+        m_stencil.zpass = zpass;
+        m_stencil.writeMask = writeMask;
     }
 
     void point(int x, int y, int z);
@@ -49,15 +518,507 @@ public:
     void straightLineX(int x1, int x2, int y);
     void straightLineY(int y1, int y2, int x);
     void triangle(const Vertex vs[3]);
+    // Custom shading, vertices need at least Shader::ATTRIBS attributes
+    template <size_t M, typename Shader>
+    void triangle(const vec<M, float> vs[3], const Shader &shader)
+    {
+        fillTriangle(vs, shader);
+    }
+    // Only z-buffer, no color nor attributes. For shadow maps and depth
+    // pre-passes, gives the same depths as triangle().
+    template <size_t M>
+    void depthTriangle(const vec<M, float> vs[3])
+    {
+        fillTriangle(vs, DepthOnly());
+    }
 
-    int width()
+    int width() const
     {
-        return m_surface.width();
+        return m_frame.width();
     }
-    int height()
+    int height() const
     {
-        return m_surface.height();
+        return m_frame.height();
     }
 };
 
+// Saturating add of xRGB8888, channels carry into the spare bits above
+// them and those turn into 0xFF
+static inline uint32_t addRGB(uint32_t a, uint32_t b)
+{
+    uint32_t rb = (a & 0xFF00FF) + (b & 0xFF00FF);
+    uint32_t g = (a & 0x00FF00) + (b & 0x00FF00);
+    rb |= (rb & 0x1000100) - ((rb & 0x1000100) >> 8);
+    g |= (g & 0x10000) - ((g & 0x10000) >> 8);
+    return (rb & 0xFF00FF) | (g & 0x00FF00);
+}
+
+// One pixel of Canvas::Blend mode, s carries alpha in the top byte.
+// Gives what the vectorized span blending does, bit for bit.
+static inline uint32_t blendRGB(uint32_t d, uint32_t s, Canvas::Blend mode)
+{
+    uint32_t a = s >> 24;
+    a += a >> 7;                // 0..256
+    switch (mode) {
+    case Canvas::ALPHA:
+        return lerpRGB(d, s, a);
+    case Canvas::ADDITIVE:
+        return addRGB(d, lerpRGB(0, s, a));
+    case Canvas::PREMULTIPLIED:
+        return addRGB(lerpRGB(d, 0, a), s);
+    default:
+        return s;
+    }
+}
+
+// blendRGB() over n pixels, vectorized where SSE2 is
+void blendSpan(uint32_t *dst, const uint32_t *src, int n, Canvas::Blend mode);
+
+template <typename V>
+static bool cmpY(const V &a, const V &b)
+{
+    return a.y() < b.y();
+}
+
+template <typename V>
+static V lerpY(const V &a, const V &b, int y)
+{
+    V d = b-a;
+    return a+(d/d.y())*(y-a.y());
+}
+
+// Stencil is an integral_constant of STENCIL_*, so the common case
+// doesn't carry the branches
+template <typename Shader, typename Stencil>
+void Canvas::scanlineTriangle(const ScreenVertex<Shader::ATTRIBS> vt[3],
+                              int dir, Shader shader, Stencil)
+{
+    enum { N = Shader::ATTRIBS };
+    typedef ScreenVertex<N> SV;
+    typedef std::integral_constant<bool, Shader::OUTPUTS == 1> single;
+
+    // Indeces specify requred order
+    static const int idx1[3] = { 0, 1, 2};
+    static const int idx2[3] = { 2, 0, 1};
+    const int *idx;
+    int l0, r0;
+
+    if (dir == UP_DOWN) {
+        idx = idx1;
+        l0 = r0 = 0;
+    } else {
+        idx = idx2;
+        l0 = 1;
+        r0 = 2;
+    }
+
+    float dy = vt[idx[2]].y() - vt[idx[0]].y();
+
+    SV v[3];
+    for (int i = 0; i < 3; i++)
+        v[i] = vt[idx[i]];
+    if (v[1].x() > v[2].x())
+        std::swap(v[1], v[2]);
+
+    SV dvl = (v[1]-v[0])/dy;    // Change in left line
+    SV dvr = (v[2]-v[0])/dy;    // Change in right line
+    SV vl = v[l0];              // Left interpolant
+    SV vr = v[r0];              // Right interpolant
+
+    // Pixels between reciprocals, affine in between
+    int step = m_perspStep ? m_perspStep : nl32::max();
+    // Blended pixels on shared edges would be drawn twice, then the right
+    // edge and the bottom row don't belong to the triangle
+    const int open = m_blend != REPLACE;
+    const int left = m_scissor.x0, right = m_scissor.x1;
+    const int top = m_scissor.y0, bottom = m_scissor.y1;
+    const bool stencil = Stencil::value == STENCIL_TEST;
+    const int32_t keep = Stencil::value == STENCIL_ZERO ? 0 : STENCIL_MASK;
+    // Fragments keep their depth apart, the z-buffer stays opaque only
+    const bool oit = open && orderIndependent();
+    int32_t *zspan = oit ? &m_spanDepth[0] : NULL;
+    // Attributes and their change along x, +1 so N can be 0
+    float a[N+1], da[N+1];
+
+    // Interpolate me baby!
+    for (int y = vt[0].y(); y <= vt[2].y() - open; y++, vl += dvl, vr += dvr) {
+        if (y < top)
+            continue;
+        if (y > bottom)
+            break;
+
+        SV ddv = vr-vl;
+        SV d;                   // Change along x
+        if (ddv.x() > 0)
+            d = ddv/ddv.x();
+
+        // Step to the first pixel center inside the span. Pixels left
+        // of the scissor are stepped over, not skipped, so they
+        // interpolate the same with or without it.
+        int x = std::max<int>(ceilf(vl.x()), 0);
+        int xe = std::min<int>(open ? ceilf(vr.x())-1 : floorf(vr.x()), width()-1);
+        SV p = vl + d*(x-vl.x());
+        // z from the span start, not accumulated, so depthSpan() matches
+        float z0 = p.z(), dz = d.z();
+        int x0 = x;
+        int xl = std::max(x, left), xr = std::min(xe, right);
+        if (xl > xr)
+            continue;
+
+        int32_t *zbuf = m_zBuffer + (size_t)y*m_stride;
+        int32_t *zout = oit ? zspan : m_depthWrite ? zbuf : NULL;
+        if (IsDepthOnly<Shader>::value) {
+            if (stencil)
+                stencilDepthSpan(zbuf, x0, xl, xr, z0, dz);
+            else
+                depthSpan(zbuf, x0, xl, xr, z0, dz);
+            continue;
+        }
+
+        float rq = 1/p[3];
+        for (int i = 0; i < N; i++)
+            a[i] = p[4+i]*rq;
+
+        if (N > 0) {
+            SV dyv = dvl - d*dvl.x(); // Change along y
+            float ddx[N+1], ddy[N+1];
+            for (int i = 0; i < N; i++) {
+                ddx[i] = (d[4+i]-a[i]*d[3])*rq;
+                ddy[i] = (dyv[4+i]-a[i]*dyv[3])*rq;
+            }
+            shader.lod(a, ddx, ddy);
+        }
+
+        uint32_t *rows[Shader::OUTPUTS];
+        for (int o = 0; o < Shader::OUTPUTS; o++)
+            rows[o] = (uint32_t*)m_targets[o]->pixels(0, y);
+        // Blending goes through a span, pixels not drawn stay
+        // transparent black which blends to nothing
+        uint32_t *out = rows[0];
+        if (open) {
+            out = &m_span[0];
+            std::fill(out + xl, out + xr+1, 0);
+        }
+        if (oit)
+            std::fill(zspan + xl, zspan + xr+1, nl32::max());
+        while (x <= xr) {
+            int n = std::min(step, xe-x+1);
+            int end = std::min(x+n, xr+1);
+            SV e = p + d*n;
+            rq = 1/e[3];
+            for (int i = 0; i < N; i++)
+                da[i] = (e[4+i]*rq - a[i])/n;
+
+            if (x+n <= xl)
+                x += n;         // All left of the scissor
+            else for (; x < xl; x++)
+                for (int i = 0; i < N; i++)
+                    a[i] += da[i];
+            for (; x < end; x++) {
+                int32_t zw = depthAt(z0 + (x-x0)*dz);
+                uint32_t color[Shader::OUTPUTS];
+                // Depth test first, shade only visible pixels
+                int32_t zold = zbuf[x];
+                bool pass = zw <= zold;
+                if (stencil) {
+                    pass = stencilTest(zold, pass);
+                    zbuf[x] = zold;
+                }
+                if (pass && shadePixel(shader, a, color, single())) {
+                    out[x] = color[0];
+                    for (int o = 1; o < Shader::OUTPUTS; o++)
+                        rows[o][x] = color[o];
+                    if (stencil)
+                        zbuf[x] = zold = applyStencil(m_stencil.zpass, zold);
+                    if (zout)
+                        zout[x] = zw | (zold & keep);
+                }
+                for (int i = 0; i < N; i++)
+                    a[i] += da[i];
+            }
+            p = e;
+            for (int i = 0; i < N; i++)
+                a[i] = e[4+i]*rq;
+        }
+        if (oit)
+            appendFragments(y, xl, xr);
+        else if (open)
+            blendSpan(rows[0] + xl, out + xl, xr-xl+1, m_blend);
+    }
+}
+
+template <size_t M, typename Shader>
+void Canvas::fillTriangle(const vec<M, float> vs[3], const Shader &shader)
+{
+    enum { N = Shader::ATTRIBS };
+    typedef ScreenVertex<N> SV;
+    static_assert(M >= 3+N, "shader needs more vertex attributes");
+    static_assert((int)Shader::OUTPUTS <= (int)MAX_TARGETS,
+                  "too many shader outputs");
+    for (int o = 0; o < Shader::OUTPUTS; o++)
+        assert(m_targets[o] != NULL);
+    if (!IsDepthOnly<Shader>::value)
+        touchTargets();
+
+    if (m_samples > 1 && !IsDepthOnly<Shader>::value
+        && !(m_blend != REPLACE && orderIndependent()))
+        return sampledTriangle(vs, shader);
+
+    SV vt[3];
+    for (int i = 0; i < 3; i++) {
+        float q = m_perspStep ? 1/vs[i].z() : 1;
+        vt[i][0] = vs[i][0];
+        vt[i][1] = vs[i][1];
+        vt[i][2] = m_perspStep ? q : vs[i][2];
+        vt[i][3] = q;
+        for (int j = 0; j < N; j++)
+            vt[i][4+j] = vs[i][3+j]*q;
+    }
+    std::sort(vt, vt+3, cmpY<SV>);
+
+    if (vt[0].y() == vt[2].y())
+        return;                 // Empty triangle
+    float xmin = std::min(std::min(vt[0].x(), vt[1].x()), vt[2].x());
+    float xmax = std::max(std::max(vt[0].x(), vt[1].x()), vt[2].x());
+    if (vt[2].y() < m_scissor.y0 || vt[0].y() > m_scissor.y1
+        || xmax < m_scissor.x0 || xmin > m_scissor.x1)
+        return;
+
+    auto scan = [&](const SV v[3], int dir) {
+        typedef std::integral_constant<int, STENCIL_TEST> test;
+        typedef std::integral_constant<int, STENCIL_KEEP> keep;
+        typedef std::integral_constant<int, STENCIL_ZERO> zero;
+        if (m_stencil.enabled)
+            scanlineTriangle(v, dir, shader, test());
+        else if (m_stencil.dirty)
+            scanlineTriangle(v, dir, shader, keep());
+        else
+            scanlineTriangle(v, dir, shader, zero());
+    };
+
+    if (vt[0].y() == vt[1].y())
+        scan(vt, DOWN_UP);
+    else if (vt[1].y() == vt[2].y())
+        scan(vt, UP_DOWN);
+    else {
+        // Make two "flat" triangles
+        SV vh[3];
+
+        int hy = vt[1].y();
+        SV h = lerpY(vt[0], vt[2], hy);
+        h[1] = hy;
+
+        vh[0] = vt[0];
+        vh[1] = vt[1];
+        vh[2] = h;
+        scan(vh, UP_DOWN);
+
+        vh[0] = h;
+        vh[1] = vt[1];
+        vh[2] = vt[2];
+        scan(vh, DOWN_UP);
+    }
+}
+
+// Half-space rasterizer for multisampling. Edge functions are exact at
+// any sample position where scanlines only know pixel centers. Depth,
+// 1/w and attributes/w are planes over the screen.
+template <size_t M, typename Shader>
+void Canvas::sampledTriangle(const vec<M, float> vs[3], Shader shader)
+{
+    enum { N = Shader::ATTRIBS, P = 2+N };
+    typedef std::integral_constant<bool, Shader::OUTPUTS == 1> single;
+    const int S = m_samples;
+    const uint32_t full = (1u << S) - 1;
+
+    float area = (vs[1].x()-vs[0].x())*(vs[2].y()-vs[0].y())
+        - (vs[2].x()-vs[0].x())*(vs[1].y()-vs[0].y());
+    if (area == 0)
+        return;
+
+    // Edge i is opposite to vertex i and positive inside, whatever the
+    // winding. Divided by the area they are the barycentrics.
+    float ea[3], eb[3], ec[3], ria[3];
+    float sign = area > 0 ? 1 : -1;
+    for (int i = 0; i < 3; i++) {
+        const vec<M, float> &p = vs[(i+1)%3], &q = vs[(i+2)%3];
+        ea[i] = sign*(p.y() - q.y());
+        eb[i] = sign*(q.x() - p.x());
+        ec[i] = sign*(p.x()*q.y() - q.x()*p.y());
+        ria[i] = ea[i] ? -1/ea[i] : 0;
+    }
+
+    // Planes c + dx*x + dy*y of depth, 1/w and attributes/w
+    float pc[P], px[P], py[P];
+    for (int j = 0; j < P; j++)
+        pc[j] = px[j] = py[j] = 0;
+    float ra = 1/(sign*area);
+    for (int i = 0; i < 3; i++) {
+        float q = m_perspStep ? 1/vs[i].z() : 1;
+        float f[P];
+        f[0] = m_perspStep ? q : vs[i].z();
+        f[1] = q;
+        for (int j = 0; j < N; j++)
+            f[2+j] = vs[i][3+j]*q;
+        for (int j = 0; j < P; j++) {
+            pc[j] += f[j]*ec[i]*ra;
+            px[j] += f[j]*ea[i]*ra;
+            py[j] += f[j]*eb[i]*ra;
+        }
+    }
+
+    // Edges and depth at each sample relative to the pixel center, and
+    // how far inside the center must be for all samples to be
+    float eoff[3][MAX_SAMPLES], zoff[MAX_SAMPLES], inner[3] = { 0, 0, 0 };
+    for (int s = 0; s < S; s++) {
+        for (int i = 0; i < 3; i++) {
+            eoff[i][s] = ea[i]*m_pattern[s][0] + eb[i]*m_pattern[s][1];
+            inner[i] = std::max(inner[i], -eoff[i][s]);
+        }
+        zoff[s] = px[0]*m_pattern[s][0] + py[0]*m_pattern[s][1];
+    }
+
+    float xmin = std::min(std::min(vs[0].x(), vs[1].x()), vs[2].x());
+    float xmax = std::max(std::max(vs[0].x(), vs[1].x()), vs[2].x());
+    float ymin = std::min(std::min(vs[0].y(), vs[1].y()), vs[2].y());
+    float ymax = std::max(std::max(vs[0].y(), vs[1].y()), vs[2].y());
+    int ys = std::max<int>(ceilf(ymin - 0.5f), m_scissor.y0);
+    int ye = std::min<int>(floorf(ymax + 0.5f), m_scissor.y1);
+    float a[N+1], ddx[N+1], ddy[N+1];
+
+    for (int y = ys; y <= ye; y++) {
+        // Pixels whose samples may be inside, from where the edges
+        // cross the top and bottom of the row
+        float l = xmin, r = xmax;
+        for (int i = 0; i < 3; i++) {
+            if (ea[i] == 0)
+                continue;
+            float top = (eb[i]*(y-0.5f) + ec[i])*ria[i];
+            float bottom = (eb[i]*(y+0.5f) + ec[i])*ria[i];
+            if (ea[i] > 0)
+                l = std::max(l, std::min(top, bottom));
+            else
+                r = std::min(r, std::max(top, bottom));
+        }
+        int x = std::max<int>(ceilf(l - 0.5f), 0);
+        int xe = std::min<int>(floorf(r + 0.5f), width()-1);
+        if (std::max(x, m_scissor.x0) > std::min(xe, m_scissor.x1))
+            continue;
+
+        float q0 = pc[1] + px[1]*x + py[1]*y;
+        for (int j = 0; j < N; j++) {
+            a[j] = (pc[2+j] + px[2+j]*x + py[2+j]*y)/q0;
+            ddx[j] = (px[2+j] - a[j]*px[1])/q0;
+            ddy[j] = (py[2+j] - a[j]*py[1])/q0;
+        }
+        if (N > 0)
+            shader.lod(a, ddx, ddy);
+        // After the level of detail, which is taken at the span start
+        x = std::max(x, m_scissor.x0);
+        xe = std::min(xe, m_scissor.x1);
+
+        int32_t *zbuf = m_zBuffer + (size_t)y*m_stride;
+        const uint32_t *slots = &m_sampleSlot[(size_t)y*m_stride];
+        uint32_t *rows[Shader::OUTPUTS];
+        for (int o = 0; o < Shader::OUTPUTS; o++)
+            rows[o] = (uint32_t*)m_targets[o]->pixels(0, y);
+
+        // Pixels in [xi, xie] have all samples inside, edges are only
+        // tested near the ends
+        int xi = x, xie = xe;
+        for (int i = 0; i < 3; i++) {
+            float e0 = eb[i]*y + ec[i] - inner[i];
+            if (ea[i] == 0) {
+                if (e0 < 0)
+                    xie = xi-1;
+                continue;
+            }
+            float b = std::min(std::max(e0*ria[i], x-1.f), xe+1.f);
+            if (ea[i] > 0)
+                xi = std::max<int>(xi, ceilf(b));
+            else
+                xie = std::min<int>(xie, floorf(b));
+        }
+
+        for (; x <= xe; x++) {
+            uint32_t mask = 0;
+            if (x >= xi && x <= xie)
+                mask = full;
+            else {
+                float e[3];
+                for (int i = 0; i < 3; i++)
+                    e[i] = ea[i]*x + eb[i]*y + ec[i];
+                for (int s = 0; s < S; s++)
+                    if (e[0] + eoff[0][s] >= 0 && e[1] + eoff[1][s] >= 0
+                        && e[2] + eoff[2][s] >= 0)
+                        mask |= 1 << s;
+                if (!mask)
+                    continue;
+            }
+
+            size_t pixel = (size_t)y*m_stride + x;
+            uint32_t slot = slots[x];
+            float zc = pc[0] + px[0]*x + py[0]*y;
+            int32_t zs[MAX_SAMPLES];
+            uint32_t pass = 0;
+            if (!slot && mask == full) {
+                // Whole pixel against whole pixel, one test
+                if (depthAt(zc) <= zbuf[x])
+                    pass = full;
+            } else {
+                const int32_t *sd = slot ? &m_sampleDepth[(slot-1)*S] : NULL;
+                for (int s = 0; s < S; s++) {
+                    zs[s] = eyeZ(zc + zoff[s])*DEPTH_SCALE;
+                    if (mask & 1 << s && zs[s] <= (sd ? sd[s] : depthOf(zbuf[x])))
+                        pass |= 1 << s;
+                }
+            }
+            if (!pass)
+                continue;
+
+            // Partly covered pixels shade at a covered sample, the
+            // center may be outside and attributes out of their range
+            float sx = x, sy = y;
+            if (mask != full) {
+                const float *o = m_pattern[__builtin_ctz(mask)];
+                sx += o[0];
+                sy += o[1];
+            }
+            float q = pc[1] + px[1]*sx + py[1]*sy;
+            for (int j = 0; j < N; j++)
+                a[j] = (pc[2+j] + px[2+j]*sx + py[2+j]*sy)/q;
+            uint32_t color[Shader::OUTPUTS];
+            if (!shadePixel(shader, a, color, single()))
+                continue;
+            for (int o = 1; o < Shader::OUTPUTS; o++)
+                rows[o][x] = color[o];
+
+            // Blending over separate samples has to keep them
+            if (pass == full && !(slot && m_blend != REPLACE)) {
+                if (slot)
+                    dropSamples(pixel);
+                rows[0][x] = blendRGB(rows[0][x], color[0], m_blend);
+                if (m_depthWrite)
+                    zbuf[x] = depthAt(zc) | stencilOf(zbuf[x]);
+                continue;
+            }
+
+            if (!slot)
+                slot = newSlot(pixel, rows[0][x], depthOf(zbuf[x]));
+            uint32_t *sc = &m_sampleColor[(slot-1)*S];
+            int32_t *sd = &m_sampleDepth[(slot-1)*S];
+            // The z-buffer keeps the nearest sample for depth()
+            for (int s = 0; s < S; s++)
+                if (pass & 1 << s) {
+                    sc[s] = blendRGB(sc[s], color[0], m_blend);
+                    if (m_depthWrite) {
+                        sd[s] = zs[s];
+                        zbuf[x] = std::min(zbuf[x],
+                                           depthWord(zs[s]) | stencilOf(zbuf[x]));
+                    }
+                }
+        }
+    }
+}
+
 #endif
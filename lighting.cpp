@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <vector>
+
+#include "lighting.h"
+#include "simd.h"
+
+// Schlick's approximation of pow(x, n), no transcendentals
+static inline float8 specPow(float8 x, float n)
+{
+    return x/(n - n*x + x);
+}
+
+struct Vec8 {
+    float8 x, y, z;
+
+    float8 dot(const Vec8 &b) const
+    {
+        return x*b.x + y*b.y + z*b.z;
+    }
+    void scale(float8 s)
+    {
+        x *= s;
+        y *= s;
+        z *= s;
+    }
+    void normalize()
+    {
+        scale(rsqrt(dot(*this) + 1e-12f));
+    }
+};
+
+// Only the z-buffer of the map is used, the frame is never presented
+static const PixelFormat mapFormat = {
+    4,
+    0xFF0000, 0x00FF00, 0x0000FF, 0,
+    16, 8, 0, 24,
+    0, 0, 0, 8
+};
+
+ShadowMap::ShadowMap(int size)
+    : m_surface(size, size, mapFormat)
+    , m_canvas(m_surface)
+    , m_pcf(0)
+    , m_bias(0.03f)
+{
+    // Orthographic, depth is linear on the map
+    m_canvas.perspective(0);
+    m_view.loadIdentity();
+}
+
+// How much of the light reaches eye positions e, 0..1. Outside of
+// the map is lit.
+static float8 shadowed(const ShadowMap &sm, const Vec8 &e)
+{
+    const Matrix4f &m = sm.view();
+    const Canvas &c = sm.canvas();
+    float8 x = m[0][0]*e.x + m[1][0]*e.y + m[2][0]*e.z + m[3][0];
+    float8 y = m[0][1]*e.x + m[1][1]*e.y + m[2][1]*e.z + m[3][1];
+    float8 z = m[0][2]*e.x + m[1][2]*e.y + m[2][2]*e.z + m[3][2];
+    float8 w = m[0][3]*e.x + m[1][3]*e.y + m[2][3]*e.z + m[3][3];
+    x /= w;
+    y /= w;
+    z = (z - sm.bias())*float(Canvas::DEPTH_SCALE);
+
+    const int r = sm.pcf();
+    const int mw = c.width(), mh = c.height();
+    const float taps = 1.f/((2*r+1)*(2*r+1));
+    float8 lit;
+    for (int k = 0; k < 8; k++) {
+        int cx = floorf(x[k] + 0.5f);
+        int cy = floorf(y[k] + 0.5f);
+        if (cx < 0 || cx >= mw || cy < 0 || cy >= mh) {
+            lit[k] = 1;
+            continue;
+        }
+
+        int n = 0;
+        for (int ty = cy-r; ty <= cy+r; ty++) {
+            const int32_t *row = c.depth(std::min(std::max(ty, 0), mh-1));
+            for (int tx = cx-r; tx <= cx+r; tx++)
+                n += z[k] <= Canvas::depthOf(row[std::min(std::max(tx, 0), mw-1)]);
+        }
+        lit[k] = n*taps;
+    }
+    return lit;
+}
+
+// Adds the diffuse and specular of one light at eye positions e with
+// unit normals nr, view points from e to the eye
+static inline void addLight(const Light &light, const Material &material,
+                            const Vec8 &e, const Vec8 &nr, const Vec8 &view,
+                            Vec8 &color)
+{
+    const vec4f &lp = light.position;
+    Vec8 dir;
+    float8 att = float8{} + 1;
+
+    if (lp.w() == 0) {
+        vec3f d = vec3f(lp).normalized();
+        dir.x = float8{} + d.x();
+        dir.y = float8{} + d.y();
+        dir.z = float8{} + d.z();
+    } else {
+        dir.x = lp.x() - e.x;
+        dir.y = lp.y() - e.y;
+        dir.z = lp.z() - e.z;
+        float8 d2 = dir.dot(dir);
+        dir.scale(rsqrt(d2 + 1e-12f));
+        att = max0(1 - d2/(light.radius*light.radius));
+        att *= att;
+    }
+    if (light.shadow)
+        att *= shadowed(*light.shadow, e);
+
+    float8 ndl = max0(nr.dot(dir));
+    Vec8 half = { dir.x + view.x, dir.y + view.y, dir.z + view.z };
+    half.normalize();
+    float8 spec = specPow(max0(nr.dot(half)), material.shininess);
+    spec = select8(lt8(float8{}, ndl), spec, float8{});
+
+    const vec4f &kd = material.diffuse;
+    const vec4f &ks = material.specular;
+    color.x += (kd[0]*ndl + ks[0]*spec)*(att*light.color[0]);
+    color.y += (kd[1]*ndl + ks[1]*spec)*(att*light.color[1]);
+    color.z += (kd[2]*ndl + ks[2]*spec)*(att*light.color[2]);
+}
+
+static inline Vec8 ambient(const Material &material)
+{
+    Vec8 c = {
+        float8{} + material.ambient[0],
+        float8{} + material.ambient[1],
+        float8{} + material.ambient[2]
+    };
+    return c;
+}
+
+// 0..1 to 0..255, saturating
+static inline float8 toByte(float8 x)
+{
+    return min8(x, float8{} + 1)*255;
+}
+
+void lightVertices(const Matrix4f &modelView, const Material &material,
+                   const Light *lights, int nlights,
+                   const float *vertices, const float *normals, size_t n,
+                   vec3f *colors)
+{
+    const Matrix4f &m = modelView;
+    Matrix<3, 3, float> nm = normalMatrix(modelView);
+
+    for (size_t base = 0; base < n; base += 8) {
+        // Gather into lanes, the tail repeats the last vertex
+        Vec8 p, nv;
+        for (int k = 0; k < 8; k++) {
+            size_t i = std::min(base+k, n-1);
+            const float *v = vertices + 3*i;
+            const float *nn = normals + 3*i;
+            p.x[k] = v[0];
+            p.y[k] = v[1];
+            p.z[k] = v[2];
+            nv.x[k] = nn[0];
+            nv.y[k] = nn[1];
+            nv.z[k] = nn[2];
+        }
+
+        // To eye space
+        Vec8 e, nr;
+        e.x = m[0][0]*p.x + m[1][0]*p.y + m[2][0]*p.z + m[3][0];
+        e.y = m[0][1]*p.x + m[1][1]*p.y + m[2][1]*p.z + m[3][1];
+        e.z = m[0][2]*p.x + m[1][2]*p.y + m[2][2]*p.z + m[3][2];
+        nr.x = nm[0][0]*nv.x + nm[1][0]*nv.y + nm[2][0]*nv.z;
+        nr.y = nm[0][1]*nv.x + nm[1][1]*nv.y + nm[2][1]*nv.z;
+        nr.z = nm[0][2]*nv.x + nm[1][2]*nv.y + nm[2][2]*nv.z;
+        nr.normalize();
+
+        // The eye is at the origin
+        Vec8 view = { -e.x, -e.y, -e.z };
+        view.normalize();
+
+        Vec8 c = ambient(material);
+        for (int l = 0; l < nlights; l++)
+            addLight(lights[l], material, e, nr, view, c);
+
+        c.x = toByte(c.x);
+        c.y = toByte(c.y);
+        c.z = toByte(c.z);
+        for (int k = 0; k < 8 && base+k < n; k++)
+            colors[base+k] = vec3(c.x[k], c.y[k], c.z[k]);
+    }
+}
+
+// Does the sphere touch the box?
+static bool sphereBox(const vec4f &c, float r,
+                      const float lo[3], const float hi[3])
+{
+    float d2 = 0;
+    for (int i = 0; i < 3; i++) {
+        float d = c[i] < lo[i] ? lo[i]-c[i] : c[i] > hi[i] ? c[i]-hi[i] : 0;
+        d2 += d*d;
+    }
+    return d2 <= r*r;
+}
+
+void shadeTiled(Canvas &canvas, const Projection &proj,
+                const Material &material, const Light *lights, int nlights,
+                bool cull)
+{
+    enum { TILE = 16 };
+    const float zs = 1.f/Canvas::DEPTH_SCALE;
+    // Tiles stay on the TILE grid, cut to the scissor
+    const Canvas::Rect &sc = canvas.scissorRect();
+    // Multisampled normals are averaged, good enough on edges
+    canvas.resolve();
+    Pixman &frame = canvas.frame();
+    frame.touch();              // Written through pixels()
+    std::vector<const Light*> tileLights;
+    tileLights.reserve(nlights);
+
+    for (int gy = sc.y0/TILE*TILE; gy <= sc.y1; gy += TILE)
+        for (int gx = sc.x0/TILE*TILE; gx <= sc.x1; gx += TILE) {
+            int tx = std::max(gx, sc.x0), ty = std::max(gy, sc.y0);
+            int tw = std::min(gx+TILE-1, sc.x1) - tx + 1;
+            int th = std::min(gy+TILE-1, sc.y1) - ty + 1;
+
+            // Depth range of what was drawn in the tile
+            int32_t zmin = nl32::max(), zmax = nl32::min();
+            for (int y = ty; y < ty+th; y++) {
+                const int32_t *zrow = canvas.depth(y);
+                for (int x = tx; x < tx+tw; x++) {
+                    int32_t z = Canvas::depthOf(zrow[x]);
+                    if (z != Canvas::DEPTH_FAR) {
+                        zmin = std::min(zmin, z);
+                        zmax = std::max(zmax, z);
+                    }
+                }
+            }
+            if (zmin > zmax)
+                continue;           // Empty
+
+            // Eye space box around the tile's pixels
+            float lo[3] = { 1e30f, 1e30f, zmin*zs };
+            float hi[3] = { -1e30f, -1e30f, zmax*zs };
+            for (int i = 0; i < 2; i++)
+                for (int j = 0; j < 2; j++) {
+                    float z = i ? hi[2] : lo[2];
+                    float ex = (tx + j*tw - proj.cx)/proj.fx*z;
+                    float ey = (ty + j*th - proj.cy)/proj.fy*z;
+                    lo[0] = std::min(lo[0], ex);
+                    hi[0] = std::max(hi[0], ex);
+                    lo[1] = std::min(lo[1], ey);
+                    hi[1] = std::max(hi[1], ey);
+                }
+
+            tileLights.clear();
+            for (int l = 0; l < nlights; l++) {
+                const Light &light = lights[l];
+                if (!cull || light.position.w() == 0
+                    || sphereBox(light.position, light.radius, lo, hi))
+                    tileLights.push_back(&light);
+            }
+
+            for (int y = ty; y < ty+th; y++) {
+                const int32_t *zrow = canvas.depth(y);
+                uint32_t *row = (uint32_t*)frame.pixels(0, y);
+
+                for (int x = tx; x < tx+tw; x += 8) {
+                    int n = std::min(8, tx+tw-x);
+                    // Gather the G-buffer, uncovered lanes are masked
+                    Vec8 e, nr;
+                    int mask = 0;
+                    for (int k = 0; k < 8; k++) {
+                        int i = x + std::min(k, n-1);
+                        uint32_t c = row[i];
+                        int32_t z = Canvas::depthOf(zrow[i]);
+                        e.z[k] = z*zs;
+                        e.x[k] = i;
+                        nr.x[k] = c >> 16 & 0xFF;
+                        nr.y[k] = c >> 8 & 0xFF;
+                        nr.z[k] = c & 0xFF;
+                        if (k < n && z != Canvas::DEPTH_FAR)
+                            mask |= 1 << k;
+                    }
+                    if (!mask)
+                        continue;
+
+                    e.y = float8{} + (y - proj.cy)/proj.fy;
+                    e.y *= e.z;
+                    e.x = (e.x - proj.cx)/proj.fx*e.z;
+                    nr.x = nr.x/127.5f - 1;
+                    nr.y = nr.y/127.5f - 1;
+                    nr.z = nr.z/127.5f - 1;
+                    nr.normalize();
+
+                    Vec8 view = { -e.x, -e.y, -e.z };
+                    view.normalize();
+
+                    Vec8 c = ambient(material);
+                    for (size_t l = 0; l < tileLights.size(); l++)
+                        addLight(*tileLights[l], material, e, nr, view, c);
+
+                    c.x = toByte(c.x);
+                    c.y = toByte(c.y);
+                    c.z = toByte(c.z);
+                    for (int k = 0; k < n; k++)
+                        if (mask & 1 << k)
+                            row[x+k] = (uint32_t)c.x[k] << 16
+                                | (uint32_t)c.y[k] << 8 | (uint32_t)c.z[k];
+                }
+            }
+        }
+}
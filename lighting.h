@@ -0,0 +1,137 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include "transform.h"
+#include "canvas.h"
+
+// Colors are 0..1
+struct Material {
+    vec4f ambient;
+    vec4f diffuse;
+    vec4f specular;
+    float shininess;
+};
+
+class ShadowMap;
+
+// Eye space. w = 0 is a directional light, position is then the
+// direction towards it. Point lights fade out to nothing at radius.
+// With a shadow map what it hides is unlit.
+struct Light {
+    vec4f position;
+    vec3f color;
+    float radius;
+    const ShadowMap *shadow;
+};
+
+// Depth of the scene seen from a light. Draw into canvas() with
+// depthTriangle() using view() * modelView, then attach to the Light.
+class ShadowMap {
+    Pixman m_surface;
+    Canvas m_canvas;
+    Matrix4f m_view;
+    int m_pcf;
+    float m_bias;
+public:
+    ShadowMap(int size);
+
+    // Eye space to the map: x, y are pixels after dividing by w, z is
+    // the depth. Orthographic for directional lights, a perspective
+    // view needs canvas().perspective() back on.
+    void view(const Matrix4f &m)
+    {
+        m_view = m;
+    }
+    const Matrix4f& view() const
+    {
+        return m_view;
+    }
+
+    // Percentage closer filtering over (2*radius+1)^2 texels, 0 is off
+    void pcf(int radius)
+    {
+        m_pcf = radius;
+    }
+    int pcf() const
+    {
+        return m_pcf;
+    }
+
+    // Depth offset against self shadowing, in units of z
+    void bias(float b)
+    {
+        m_bias = b;
+    }
+    float bias() const
+    {
+        return m_bias;
+    }
+
+    Canvas& canvas()
+    {
+        return m_canvas;
+    }
+    const Canvas& canvas() const
+    {
+        return m_canvas;
+    }
+};
+
+// Gouraud lighting: colors (0..255 per channel) of n vertices. Vertices
+// and normals are 3 floats each in model space, normals are moved to
+// eye space with the normal matrix of modelView. Done 8 vertices at
+// a time.
+void lightVertices(const Matrix4f &modelView, const Material &material,
+                   const Light *lights, int nlights,
+                   const float *vertices, const float *normals, size_t n,
+                   vec3f *colors);
+
+// Screen position of an eye space point: (cx + fx*x/z, cy + fy*y/z)
+struct Projection {
+    float fx, fy;
+    float cx, cy;
+};
+
+// Deferred per pixel Phong. The frame holds eye space normals written
+// by NormalShader and the z-buffer their depth, every drawn pixel is
+// replaced by its lit color. Screen is split in tiles, each shaded only
+// with the point lights reaching the box around its depth range, all
+// of them if cull is false. Directional lights light every tile. Only
+// the scissor rectangle is shaded.
+void shadeTiled(Canvas &canvas, const Projection &proj,
+                const Material &material, const Light *lights, int nlights,
+                bool cull = true);
+
+// Interpolated vertex colors, attributes are (r, g, b) 0..255. Alpha
+// only matters when the canvas blends.
+struct GouraudShader : PixelShader {
+    enum { ATTRIBS = 3 };
+    uint32_t alpha;
+
+    GouraudShader(uint32_t a = 0) : alpha(a << 24) {}
+    bool operator()(const float *rgb, uint32_t &c) const
+    {
+        c = (uint32_t)rgb[0] << 16 | (uint32_t)rgb[1] << 8 | (uint32_t)rgb[2]
+            | alpha;
+        return true;
+    }
+};
+
+// Eye space normal packed into the pixel for shadeTiled(), attributes
+// are (x, y, z) -1..1
+struct NormalShader : PixelShader {
+    enum { ATTRIBS = 3 };
+
+    static uint32_t pack(float n)
+    {
+        return std::min(std::max(n*127.5f + 127.5f, 0.f), 255.f);
+    }
+
+    bool operator()(const float *n, uint32_t &c) const
+    {
+        c = pack(n[0]) << 16 | pack(n[1]) << 8 | pack(n[2]);
+        return true;
+    }
+};
+
+#endif
@@ -10,6 +10,11 @@
 #define ENABLE_IOSTREAM
 #include "transform.h"
 #include "canvas.h"
+#include "lighting.h"
+#include "postfx.h"
+#include "ssao.h"
+#include "supersample.h"
+#include "pipeline.h"
 
 typedef enum { TRIANGLES, TRIANGLES_INDEXED, LINE_STRIP, LINE_LOOP, POINTS } prim_t;
 
@@ -28,6 +33,7 @@ struct VertexBuffer {
     VertexArray<3, int> indeces;
     VertexArray<3, float> normals;
     VertexArray<2, float> texcoords;
+    uint32_t version;           // Bumped by whoever rewrites the arrays
 };
 
 static vec4f vec4fp(const float *src)
@@ -39,14 +45,90 @@ static vec4f vec4fp(const float *src)
     return res;
 }
 
+// Unsigned key that orders like f, the largest gets the smallest
+static uint32_t farFirstKey(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    u = u >> 31 ? ~u : u | 0x80000000;
+    return ~u;
+}
+
+// LSD radix sort of order by keys, one byte a pass. Stable, tmp and
+// tmpOrder are scratch.
+static void radixSort(std::vector<uint32_t> &keys, std::vector<uint32_t> &order,
+                      std::vector<uint32_t> &tmp, std::vector<uint32_t> &tmpOrder)
+{
+    size_t n = keys.size();
+    tmp.resize(n);
+    tmpOrder.resize(n);
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t count[257] = { 0 };
+        for (size_t i = 0; i < n; i++)
+            count[(keys[i] >> shift & 0xFF) + 1]++;
+        // All in one bucket, nothing moves
+        if (count[(keys[0] >> shift & 0xFF) + 1] == n)
+            continue;
+        for (int b = 0; b < 256; b++)
+            count[b+1] += count[b];
+        for (size_t i = 0; i < n; i++) {
+            size_t j = count[keys[i] >> shift & 0xFF]++;
+            tmp[j] = keys[i];
+            tmpOrder[j] = order[i];
+        }
+        keys.swap(tmp);
+        order.swap(tmpOrder);
+    }
+}
+
 class Renderer {
     Canvas &m_canvas;
     const VertexBuffer *m_vbuffer;
-    const Pixman *m_texture;
+    vec2f m_texSize;            // Zero when untextured
     Matrix4f m_viewport;
     Matrix4f m_model;
+    Matrix4f m_modelView;
     Matrix4f m_trans;
     bool m_wire;
+    const Material *m_material;
+    const Light *m_lights;
+    int m_nlights;
+    bool m_lit;
+    bool m_phong;               // Per pixel, deferred to shade()
+    bool m_deferred;            // Frame holds normals to shade
+    ShadowMap *m_shadow;        // Depth only pass into it when set
+    std::vector<vec3f> m_colors;  // Lit vertex colors or eye normals
+    Canvas::Blend m_blend;
+    uint32_t m_alpha;           // Material alpha for Gouraud when blending
+    std::vector<float> m_depth;   // Per vertex, for sorting
+    std::vector<uint32_t> m_keys, m_order, m_tmpKeys, m_tmpOrder;
+    const void *m_texture;      // Either kind, m_tiled tells which
+    bool m_tiled;
+
+    // What a render() call drew, for partial redraws
+    struct Draw {
+        Matrix4f trans;
+        const VertexBuffer *vbuffer;
+        const void *texture;
+        uint32_t versions[2];   // Of the vertex buffer and the texture
+        const Material *material;
+        const Light *lights;
+        int nlights;
+        int state;              // Mode, wire, phong and blend
+        Canvas::Rect bounds;
+    };
+    enum { MAX_DIRTY = 4 };
+    // Anything but DRAW only records a Draw, MEASURE with its bounds
+    enum Pass { DRAW, RECORD, MEASURE } m_pass;
+    bool m_invalid;             // The next redraw() is whole
+    std::vector<Draw> m_draws, m_lastDraws;
+    std::vector<Canvas::Rect> m_dirty;
+
+    // Still draws, see staticLayer()
+    Canvas::Layer m_layer;
+    std::vector<Draw> m_layerDraws;
+    bool m_layerValid;
+    bool m_layerDeferred;       // Holds normals for shade()
 
     void drawPoints()
     {
@@ -82,12 +164,9 @@ class Renderer {
         }
     }
 
-    void setVertex(Vertex &vt, size_t n)
+    template <class V>
+    void project(V &vt, size_t n)
     {
-        bool texmap = m_texture
-            && !m_wire
-            && m_vbuffer->vertices.size <= m_vbuffer->texcoords.size;
-
         vec4f pos = m_trans * vec4fp(m_vbuffer->vertices[n]);
         float z = pos.z();
         pos /= pos.w();
@@ -95,18 +174,57 @@ class Renderer {
         vt[0] = roundf(pos.x());
         vt[1] = roundf(pos.y());
         vt[2] = z;
+    }
+
+    void setLitVertex(VertexN<3> &vt, size_t n)
+    {
+        project(vt, n);
+        for (int i = 0; i < 3; i++)
+            vt[3+i] = m_colors[n][i];
+    }
+
+    void setVertex(Vertex &vt, size_t n)
+    {
+        bool texmap = m_texSize.x() > 0
+            && !m_wire
+            && m_vbuffer->vertices.size <= m_vbuffer->texcoords.size;
+
+        project(vt, n);
         if (texmap) {
             const float *uv = m_vbuffer->texcoords[n];
-            vt[3] = (m_texture->width()-1)*uv[0]; // u
-            vt[4] = (m_texture->height()-1)*uv[1]; // v
+            vt[3] = (m_texSize.x()-1)*uv[0]; // u
+            vt[4] = (m_texSize.y()-1)*uv[1]; // v
         } else {
             vt[3] = 0;
             vt[4] = 0;
         }
     }
 
-    void drawTriangle(const Vertex vt[3])
+    void drawTriangle(const size_t idx[3])
     {
+        if (m_shadow) {
+            vec3f vt[3];
+            for (int j = 0; j < 3; j++)
+                project(vt[j], idx[j]);
+            m_shadow->canvas().depthTriangle(vt);
+            return;
+        }
+
+        if (m_lit) {
+            VertexN<3> vt[3];
+            for (int j = 0; j < 3; j++)
+                setLitVertex(vt[j], idx[j]);
+            if (m_phong)
+                m_canvas.triangle(vt, NormalShader());
+            else
+                m_canvas.triangle(vt, GouraudShader(m_alpha));
+            return;
+        }
+
+        Vertex vt[3];
+        for (int j = 0; j < 3; j++)
+            setVertex(vt[j], idx[j]);
+
         if (m_wire) {
             m_canvas.line(vt[0], vt[1]);
             m_canvas.line(vt[1], vt[2]);
@@ -119,32 +237,260 @@ class Renderer {
     {
         size_t n = m_vbuffer->vertices.size;
         assert(n % 3 == 0);
-        Vertex vt[3];
 
         for (size_t i = 0; i < n; i += 3) {
-            for (int j = 0; j < 3; j++)
-                setVertex(vt[j], i+j);
-            drawTriangle(vt);
+            size_t idx[3] = { i, i+1, i+2 };
+            drawTriangle(idx);
         }
     }
 
     void drawTrianglesIndexed()
     {
         size_t n = m_vbuffer->indeces.size;
-        Vertex vt[3];
 
         for (size_t i = 0; i < n; i++) {
-            for (int j = 0; j < 3; j++)
-                setVertex(vt[j], m_vbuffer->indeces[i][j]);
-            drawTriangle(vt);
+            const int *tri = m_vbuffer->indeces[i];
+            size_t idx[3] = { (size_t)tri[0], (size_t)tri[1], (size_t)tri[2] };
+            drawTriangle(idx);
+        }
+    }
+
+    void triangleAt(prim_t mode, size_t i, size_t idx[3]) const
+    {
+        for (int j = 0; j < 3; j++)
+            idx[j] = mode == TRIANGLES ? 3*i + j : m_vbuffer->indeces[i][j];
+    }
+
+    // Transparent, back to front by the depth sum of the vertices. Depth
+    // is tested but not written, so later triangles of the same draw
+    // aren't lost behind earlier ones. A canvas keeping fragments sorts
+    // per pixel, then draw order is fine.
+    void drawSorted(prim_t mode)
+    {
+        const VertexBuffer *vb = m_vbuffer;
+        size_t n = mode == TRIANGLES ? vb->vertices.size/3 : vb->indeces.size;
+        if (n == 0)
+            return;
+
+        m_order.resize(n);
+        for (size_t i = 0; i < n; i++)
+            m_order[i] = i;
+        if (!m_canvas.orderIndependent())
+            sortFarFirst(mode, n);
+
+        m_canvas.blend(m_blend);
+        m_canvas.depthWrite(false);
+        for (size_t i = 0; i < n; i++) {
+            size_t idx[3];
+            triangleAt(mode, m_order[i], idx);
+            drawTriangle(idx);
+        }
+        m_canvas.depthWrite(true);
+        m_canvas.blend(Canvas::REPLACE);
+    }
+
+    // Reorders m_order, triangles far from the eye first
+    void sortFarFirst(prim_t mode, size_t n)
+    {
+        const VertexBuffer *vb = m_vbuffer;
+        m_depth.resize(vb->vertices.size);
+        for (size_t i = 0; i < vb->vertices.size; i++)
+            m_depth[i] = (m_trans * vec4fp(vb->vertices[i])).z();
+
+        m_keys.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t idx[3];
+            triangleAt(mode, i, idx);
+            m_keys[i] = farFirstKey(m_depth[idx[0]] + m_depth[idx[1]]
+                                    + m_depth[idx[2]]);
+        }
+        radixSort(m_keys, m_order, m_tmpKeys, m_tmpOrder);
+    }
+
+    // Gouraud, all vertices at once before rasterizing
+    void lightVertices()
+    {
+        const VertexBuffer *vb = m_vbuffer;
+        m_lit = m_nlights > 0
+            && !m_wire
+            && !m_shadow
+            && vb->normals.size >= vb->vertices.size;
+        if (!m_lit)
+            return;
+
+        m_colors.resize(vb->vertices.size);
+        if (m_phong) {
+            Matrix<3, 3, float> nm = normalMatrix(m_modelView);
+            for (size_t i = 0; i < vb->vertices.size; i++) {
+                const float *n = vb->normals[i];
+                m_colors[i] = (nm*vec3(n[0], n[1], n[2])).normalized();
+            }
+            m_deferred = true;
+            return;
+        }
+
+        ::lightVertices(m_modelView, material(), m_lights, m_nlights,
+                        vb->vertices.data, vb->normals.data,
+                        vb->vertices.size, &m_colors[0]);
+    }
+
+    const Material& material() const
+    {
+        static const Material white = {
+            vec4(0.1f, 0.1f, 0.1f, 1.f),
+            vec4(0.8f, 0.8f, 0.8f, 1.f),
+            vec4(0.5f, 0.5f, 0.5f, 1.f),
+            32
+        };
+        return m_material ? *m_material : white;
+    }
+
+    // NDC (-1, 1) at (x, y) of the canvas, (1, -1) at (x+w, y+h)
+    void place(float x, float y, float w, float h)
+    {
+        m_viewport = translate(x, y, 0.f)
+            * scale(w/2, -h/2, 1.0f) * translate(1.0f, -1.0f, 0.0f);
+    }
+
+    template <typename T>
+    void setTexture(const T *texture)
+    {
+        if (texture)
+            m_texSize = vec2<float>(texture->width(), texture->height());
+        else
+            m_texSize = vec2f();
+        m_canvas.texture(texture);
+        m_texture = texture;
+    }
+
+    uint32_t textureVersion() const
+    {
+        if (!m_texture)
+            return 0;
+        return m_tiled ? ((const Texture*)m_texture)->version()
+            : ((const Pixman*)m_texture)->version();
+    }
+
+    // Pixels the vertex buffer can touch under m_trans. A pixel more
+    // around for smooth lines and samples off the centers.
+    Canvas::Rect screenBounds() const
+    {
+        const int w = m_canvas.width(), h = m_canvas.height();
+        float lo[2] = { 1e30f, 1e30f }, hi[2] = { -1e30f, -1e30f };
+        for (size_t i = 0; i < m_vbuffer->vertices.size; i++) {
+            vec4f pos = m_trans * vec4fp(m_vbuffer->vertices[i]);
+            pos /= pos.w();
+            for (int k = 0; k < 2; k++) {
+                lo[k] = std::min(lo[k], pos[k]);
+                hi[k] = std::max(hi[k], pos[k]);
+            }
+        }
+
+        Canvas::Rect r = { 0, 0, -1, -1 };
+        if (lo[0] > hi[0])
+            return r;
+        // Clamped before rounding, far off vertices don't fit an int
+        r.x0 = std::max<int>(floorf(std::max(lo[0], -2.f)) - 1, 0);
+        r.y0 = std::max<int>(floorf(std::max(lo[1], -2.f)) - 1, 0);
+        r.x1 = std::min<int>(ceilf(std::min(hi[0], w + 1.f)) + 1, w-1);
+        r.y1 = std::min<int>(ceilf(std::min(hi[1], h + 1.f)) + 1, h-1);
+        return r;
+    }
+
+    void record(prim_t mode)
+    {
+        Draw d;
+        d.trans = m_trans;
+        d.vbuffer = m_vbuffer;
+        d.texture = m_texture;
+        d.versions[0] = m_vbuffer->version;
+        d.versions[1] = textureVersion();
+        d.material = m_material;
+        d.lights = m_lights;
+        d.nlights = m_nlights;
+        d.state = mode | m_wire << 4 | m_phong << 5 | m_blend << 6;
+        Canvas::Rect none = { 0, 0, -1, -1 };
+        d.bounds = m_pass == MEASURE ? screenBounds() : none;
+        m_draws.push_back(d);
+    }
+
+    static bool sameDraw(const Draw &a, const Draw &b)
+    {
+        return !memcmp(&a.trans, &b.trans, sizeof(a.trans))
+            && a.vbuffer == b.vbuffer && a.texture == b.texture
+            && a.versions[0] == b.versions[0] && a.versions[1] == b.versions[1]
+            && a.material == b.material && a.lights == b.lights
+            && a.nlights == b.nlights && a.state == b.state;
+    }
+
+    // Joined with the ones it overlaps enough that drawing them
+    // apart costs more, all of them past MAX_DIRTY
+    void addDirty(Canvas::Rect r)
+    {
+        for (size_t i = 0; i < m_dirty.size(); ) {
+            Canvas::Rect u = r.join(m_dirty[i]);
+            if (u.area() <= r.area() + m_dirty[i].area()) {
+                r = u;
+                m_dirty.erase(m_dirty.begin() + i);
+                i = 0;
+            } else
+                i++;
         }
+        if (m_dirty.size() == MAX_DIRTY) {
+            for (size_t i = 0; i < m_dirty.size(); i++)
+                r = r.join(m_dirty[i]);
+            m_dirty.clear();
+        }
+        m_dirty.push_back(r);
+    }
+
+    // Old and new bounds of every draw that isn't the same as the one
+    // at its place in the last frame
+    void findDirty()
+    {
+        m_dirty.clear();
+        if (m_invalid) {
+            Canvas::Rect all = { 0, 0, m_canvas.width()-1, m_canvas.height()-1 };
+            m_dirty.push_back(all);
+            m_invalid = false;
+        } else {
+            size_t n = std::max(m_draws.size(), m_lastDraws.size());
+            for (size_t i = 0; i < n; i++) {
+                const Draw *d = i < m_draws.size() ? &m_draws[i] : NULL;
+                const Draw *l = i < m_lastDraws.size() ? &m_lastDraws[i] : NULL;
+                if (d && l && sameDraw(*d, *l))
+                    continue;
+                Canvas::Rect r = { 0, 0, -1, -1 };
+                if (d)
+                    r = r.join(d->bounds);
+                if (l)
+                    r = r.join(l->bounds);
+                if (!r.empty())
+                    addDirty(r);
+            }
+        }
+        m_lastDraws.swap(m_draws);
     }
 
 public:
     Renderer(Canvas &canvas)
         : m_canvas(canvas)
-        , m_texture(NULL)
         , m_wire(false)
+        , m_material(NULL)
+        , m_lights(NULL)
+        , m_nlights(0)
+        , m_lit(false)
+        , m_phong(false)
+        , m_deferred(false)
+        , m_shadow(NULL)
+        , m_blend(Canvas::REPLACE)
+        , m_alpha(0)
+        , m_texture(NULL)
+        , m_tiled(false)
+        , m_pass(DRAW)
+        , m_invalid(true)
+        , m_layerValid(false)
+        , m_layerDeferred(false)
     {
         float sx = m_canvas.width()/2;
         float sy = m_canvas.height()/2;
@@ -153,6 +499,22 @@ public:
         m_viewport = scale(sx, -sy, 1.0f) * translate(1.0f, -1.0f, 0.0f);
     }
 
+    // Draw into the w x h rectangle at (x, y) of the canvas, for split
+    // screens and tiles. Triangles aren't clipped, so the canvas is
+    // scissored to it too and reset() clears only it.
+    void viewport(int x, int y, int w, int h)
+    {
+        place(x, y, w, h);
+        m_canvas.scissor(x, y, w, h);
+    }
+
+    // Draw as if the canvas were the part at (x, y) of a w x h frame,
+    // for rendering big images in pieces
+    void window(int x, int y, int w, int h)
+    {
+        place(-x, -y, w, h);
+    }
+
     void transform(const Matrix4f &m)
     {
         m_model = m * m_model;
@@ -160,8 +522,14 @@ public:
 
     void texture(const Pixman *texture)
     {
-        m_texture = texture;
-        m_canvas.texture(texture);
+        setTexture(texture);
+        m_tiled = false;
+    }
+
+    void texture(const Texture *texture)
+    {
+        setTexture(texture);
+        m_tiled = true;
     }
 
     void vertexBuffer(const VertexBuffer *vb)
@@ -174,10 +542,133 @@ public:
         m_wire = enable;
     }
 
+    void material(const Material *m)
+    {
+        m_material = m;
+    }
+
+    // Eye space lights, none disables lighting
+    void lights(const Light *lights, int n)
+    {
+        m_lights = lights;
+        m_nlights = n;
+    }
+
+    // Per pixel lighting with shadeTiled(), one material for the frame
+    void phong(bool enable)
+    {
+        m_phong = enable;
+    }
+
+    // Partial redraw. draw() renders the whole frame, reset() first.
+    // It runs once to find which draws changed since the last redraw(),
+    // then again for each rectangle they cover now or did then, with
+    // the canvas scissored to it so reset() clears just that. The rest
+    // of the frame stays. Draws are told apart by transform, by the
+    // buffer, texture, material and lights pointers and by the buffer
+    // and texture versions. invalidate() after changing materials or
+    // lights in place or the canvas settings.
+    template <typename F>
+    void redraw(F draw)
+    {
+        Canvas::Rect keep = m_canvas.scissorRect();
+        m_draws.clear();
+        m_pass = MEASURE;
+        draw();
+        m_pass = DRAW;
+        findDirty();
+        for (size_t i = 0; i < m_dirty.size(); i++) {
+            m_canvas.scissor(m_dirty[i]);
+            draw();
+        }
+        m_canvas.scissor(keep);
+    }
+
+    // What the last redraw() drew, to present
+    const std::vector<Canvas::Rect>& dirty() const
+    {
+        return m_dirty;
+    }
+
+    // Redraws and the static layer start over
+    void invalidate()
+    {
+        m_invalid = true;
+        m_layerValid = false;
+    }
+
+    // Draws that stay from frame to frame, before the rest of the
+    // frame. draw() starts with reset() like in redraw(), that clears
+    // the canvas the layer is drawn on. They are drawn and kept
+    // with their depth once, later frames start from the kept layer
+    // instead of a clear while their transforms, buffers, textures,
+    // materials and lights stay the same, told apart like in redraw().
+    // What is drawn after is depth tested against it. Multisampled
+    // edges are kept resolved. Doesn't go in redraw().
+    template <typename F>
+    void staticLayer(F draw)
+    {
+        assert(m_pass == DRAW);
+        m_draws.clear();
+        m_pass = RECORD;
+        draw();
+        m_pass = DRAW;
+
+        bool same = m_layerValid && m_draws.size() == m_layerDraws.size();
+        for (size_t i = 0; same && i < m_draws.size(); i++)
+            same = sameDraw(m_draws[i], m_layerDraws[i]);
+        m_layerDraws.swap(m_draws);
+        if (same) {
+            m_canvas.restore(m_layer);
+            m_deferred = m_layerDeferred;
+            return;
+        }
+
+        draw();
+        m_canvas.save(m_layer);
+        m_layerDeferred = m_deferred;
+        m_layerValid = true;
+    }
+
+    // Light what was drawn per pixel, before presenting the frame
+    void shade()
+    {
+        if (!m_deferred)
+            return;
+
+        Projection proj = {
+            m_viewport[0][0], m_viewport[1][1],
+            m_viewport[3][0], m_viewport[3][1]
+        };
+        shadeTiled(m_canvas, proj, material(), m_lights, m_nlights);
+        m_deferred = false;
+    }
+
+    // Anything but REPLACE draws triangles sorted, with the material's
+    // diffuse alpha. Per pixel lit, wire and shadow passes stay opaque.
+    void blend(Canvas::Blend mode)
+    {
+        m_blend = mode;
+    }
+
+    // Render depth from the light into sm, NULL goes back to the canvas
+    void shadowMap(ShadowMap *sm)
+    {
+        m_shadow = sm;
+    }
+
+    // Also clears the target, the canvas or the shadow map
     void reset()
     {
         m_model.loadIdentity();
         m_vbuffer = NULL;
+        if (m_pass != DRAW)
+            return;
+        if (m_shadow) {
+            m_shadow->canvas().clearDepth();
+            return;
+        }
+        m_deferred = false;
         m_canvas.clear();
     }
 
@@ -187,14 +678,43 @@ public:
         proj.loadIdentity();
         proj[2][3] = 1;
         proj[3][3] = 0;
-        m_trans = m_viewport * proj * translate(0.f, 0.f, 1.f) * m_model;
+        m_modelView = translate(0.f, 0.f, 1.f) * m_model;
+        m_trans = m_viewport * proj * m_modelView;
+
+        if (m_pass != DRAW) {
+            if (!m_shadow)
+                record(mode);
+            return;
+        }
+        if (m_shadow) {
+            if (mode != TRIANGLES && mode != TRIANGLES_INDEXED)
+                return;
+            m_trans = m_shadow->view() * m_modelView;
+        }
+
+        lightVertices();
+
+        bool sorted = m_blend != Canvas::REPLACE
+            && !m_shadow && !m_wire && !(m_lit && m_phong);
+        m_alpha = 0;
+        if (sorted) {
+            float a = std::min(std::max(material().diffuse.w(), 0.f), 1.f);
+            m_alpha = a*255 + 0.5f;
+            m_canvas.alpha(m_alpha);
+        }
 
         switch (mode) {
         case TRIANGLES:
-            drawTriangles();
+            if (sorted)
+                drawSorted(mode);
+            else
+                drawTriangles();
             break;
         case TRIANGLES_INDEXED:
-            drawTrianglesIndexed();
+            if (sorted)
+                drawSorted(mode);
+            else
+                drawTrianglesIndexed();
             break;
         case LINE_LOOP:
             drawLines();
@@ -232,6 +752,10 @@ Pixman sdlPixman(SDL_Surface *sdlSurface)
     SDL_PixelFormat *sdlFormat = sdlSurface->format;
     PixelFormat pf;
     pf.bpp = sdlFormat->BytesPerPixel;
+    pf.lR = sdlFormat->Rloss;
+    pf.lG = sdlFormat->Gloss;
+    pf.lB = sdlFormat->Bloss;
+    pf.lA = sdlFormat->Aloss;
     pf.mR = sdlFormat->Rmask;
     pf.mG = sdlFormat->Gmask;
     pf.mB = sdlFormat->Bmask;
@@ -242,7 +766,7 @@ Pixman sdlPixman(SDL_Surface *sdlSurface)
     pf.sA = sdlFormat->Ashift;
 
     return Pixman(sdlSurface->w, sdlSurface->h,
-                  pf, (uint8_t*)sdlSurface->pixels);
+                  pf, (uint8_t*)sdlSurface->pixels, sdlSurface->pitch);
 }
 
 
@@ -270,19 +794,220 @@ void testCube(Renderer &r, float angle)
 }
 
 
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+// Binary PPM
+static bool writePPM(const Pixman &img, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return false;
+
+    fprintf(f, "P6\n%u %u\n255\n", img.width(), img.height());
+    for (uint32_t y = 0; y < img.height(); y++)
+        for (uint32_t x = 0; x < img.width(); x++) {
+            uint32_t c = img.unmapRGB(img.get(x, y));
+            uint8_t rgb[3] = { uint8_t(c >> 16), uint8_t(c >> 8), uint8_t(c) };
+            fwrite(rgb, 1, 3, f);
+        }
+
+    return fclose(f) == 0;
+}
+
+// One frame supersampled factor times in each direction, no window
+static int renderStill(const char *path, int factor)
+{
+    Supersampler ss(640, 480, factor);
+    Pixman still(640, 480, ss.canvas().format());
+    Renderer r(ss.canvas());
+    Light lights[] = {
+        { vec4(0.f, 1.f, -1.f, 0.f), vec3(0.7f, 0.7f, 0.7f), 0 },
+        { vec4(0.5f, 0.f, 0.5f, 1.f), vec3(1.f, 0.4f, 0.2f), 1.5f },
+    };
+    r.lights(lights, 2);
+
+    double t = now();
+    ss.render(still, [&](int y) {
+        r.window(0, y, ss.width(), ss.height());
+        r.reset();
+        testBunny(r, 0.5f);
+    });
+    printf("%dx supersampled in %.0f ms\n", factor, (now() - t)*1e3);
+
+    if (!writePPM(still, path)) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+// The wire bunny drawn on a thread of its own into one of buffers
+// canvases, while the frame before is presented
+static int runPipelined(int buffers)
+{
+    SDL_Init(SDL_INIT_VIDEO);
+
+    SDL_Surface *screen = SDL_SetVideoMode(640, 480, 24, SDL_SWSURFACE|SDL_DOUBLEBUF);
+    assert(screen != NULL);
+    Pixman pscreen = sdlPixman(screen);
+
+    FramePipeline frames(pscreen, buffers);
+    Light lights[] = {
+        { vec4(0.f, 1.f, -1.f, 0.f), vec3(0.7f, 0.7f, 0.7f), 0 },
+        { vec4(0.5f, 0.f, 0.5f, 1.f), vec3(1.f, 0.4f, 0.2f), 1.5f },
+    };
+    // A renderer per canvas, they keep what they drew last in it
+    std::vector<Renderer*> renderers;
+    for (int i = 0; i < frames.buffers(); i++) {
+        Renderer *r = new Renderer(frames.canvas(i));
+        r->lights(lights, 2);
+        r->wire(true);
+        frames.canvas(i).smoothLines(true);
+        renderers.push_back(r);
+    }
+
+    frames.start([&](int i, int n) {
+        Renderer &r = *renderers[i];
+        r.reset();
+        testBunny(r, n*0.01f);
+        r.shade();
+    });
+
+    bool run = true;
+    while (run) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+            switch (event.type) {
+            case SDL_QUIT:
+                run = false;
+                break;
+            default:
+                continue;
+            }
+
+        int i = frames.acquire();
+        frames.canvas(i).present();
+        SDL_Flip(screen);
+        frames.release(i);
+    }
+    frames.stop();
+
+    FramePipeline::Stats s = frames.stats();
+    printf("%d frames, %d buffers: %.1f frames/s, latency %.1f ms mean, "
+           "%.1f ms max\n", s.frames, frames.buffers(), s.frames/s.elapsed,
+           s.latency*1e3, s.maxLatency*1e3);
+    printf("render thread waited %.0f ms, presenting %.0f ms\n",
+           s.renderWait*1e3, s.presentWait*1e3);
+
+    for (size_t i = 0; i < renderers.size(); i++)
+        delete renderers[i];
+    SDL_Quit();
+    return 0;
+}
+
+// A still cube kept in the static layer, the bunny turning through it
+// is drawn over it every frame
+static int runLayered()
+{
+    SDL_Init(SDL_INIT_VIDEO);
+
+    SDL_Surface *screen = SDL_SetVideoMode(640, 480, 24, SDL_SWSURFACE|SDL_DOUBLEBUF);
+    assert(screen != NULL);
+    Pixman pscreen = sdlPixman(screen);
+
+    Canvas canvas(pscreen);
+    Renderer r(canvas);
+    Light lights[] = {
+        { vec4(0.f, 1.f, -1.f, 0.f), vec3(0.7f, 0.7f, 0.7f), 0 },
+        { vec4(0.5f, 0.f, 0.5f, 1.f), vec3(1.f, 0.4f, 0.2f), 1.5f },
+    };
+    r.lights(lights, 2);
+    float angle = 0.0f;
+
+    bool run = true;
+    while (run) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+            switch (event.type) {
+            case SDL_QUIT:
+                run = false;
+                break;
+            default:
+                continue;
+            }
+
+        r.staticLayer([&] {
+            r.reset();
+            testCube(r, 0.5f);
+        });
+        testBunny(r, angle);
+        r.shade();
+        canvas.present();
+        SDL_Flip(screen);
+
+        angle += 0.01f;
+    }
+
+    SDL_Quit();
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    // -o file.ppm [factor] renders a still instead
+    if (argc > 2 && !strcmp(argv[1], "-o"))
+        return renderStill(argv[2], argc > 3 ? atoi(argv[3]) : 4);
+    // -p [buffers] renders on a thread of its own
+    if (argc > 1 && !strcmp(argv[1], "-p"))
+        return runPipelined(argc > 2 ? atoi(argv[2]) : 2);
+    // -s keeps a still cube in the static layer
+    if (argc > 1 && !strcmp(argv[1], "-s"))
+        return runLayered();
+
     SDL_Init(SDL_INIT_VIDEO);
 
     SDL_Surface *screen = SDL_SetVideoMode(640, 480, 24, SDL_SWSURFACE|SDL_DOUBLEBUF);
     assert(screen != NULL);
     Pixman pscreen = sdlPixman(screen);
-    Pixman texture = test_texture(pscreen.format());
 
     Canvas canvas(pscreen);
+    Texture texture(test_texture(canvas.format()));
     Renderer r(canvas);
+    //canvas.multisample(4);
     //r.texture(&texture);
+    //canvas.filter(Texture::TRILINEAR);
+    Light lights[] = {
+        { vec4(0.f, 1.f, -1.f, 0.f), vec3(0.7f, 0.7f, 0.7f), 0 },
+        { vec4(0.5f, 0.f, 0.5f, 1.f), vec3(1.f, 0.4f, 0.2f), 1.5f },
+    };
+    r.lights(lights, 2);
+    //r.phong(true);
+    //r.blend(Canvas::ALPHA);
+    //canvas.orderIndependent(1 << 20);
+
+    // Orthographic from the first light, (0, 1, -1) turned to look down z
+    const int shadowSize = 512;
+    float ss = shadowSize/2;
+    ShadowMap shadow(shadowSize);
+    shadow.view(translate(ss, ss, 2.f) * scale(ss/1.2f, -ss/1.2f, 1.f)
+                * rotate(-float(M_PI)/4, 1.f, 0.f, 0.f)
+                * translate(0.f, 0.f, -1.f));
+    shadow.pcf(1);
+    //lights[0].shadow = &shadow;
+
+    AmbientOcclusion ao;
+
+    // Empty presents the frame as is
+    PostProcess post;
+    //post.fxaa();
+    //post.vignette(0.6f);
     r.wire(true);
+    canvas.smoothLines(true);
     float angle = 0.0f;
 
     bool run = true;
@@ -297,10 +1022,39 @@ int main(int argc, char **argv)
                 continue;
             }
 
-        r.reset();
-        //testCube(r, angle);
-        testBunny(r, angle);
-        SDL_Flip(screen);
+        if (lights[0].shadow) {
+            r.shadowMap(&shadow);
+            r.reset();
+            testBunny(r, angle);
+            r.shadowMap(NULL);
+        }
+
+        // Only what the bunny covers now or did last frame, passes
+        // over the whole frame need r.invalidate() every frame
+        r.redraw([&] {
+            r.reset();
+            //testCube(r, angle);
+            testBunny(r, angle);
+            r.shade();
+        });
+        //ao.apply(canvas);
+        if (post.empty()) {
+            const std::vector<Canvas::Rect> &dirty = r.dirty();
+            std::vector<SDL_Rect> rects(dirty.size());
+            for (size_t i = 0; i < dirty.size(); i++) {
+                const Canvas::Rect &d = dirty[i];
+                canvas.present(d);
+                SDL_Rect sr = { (Sint16)d.x0, (Sint16)d.y0,
+                                (Uint16)(d.x1-d.x0+1), (Uint16)(d.y1-d.y0+1) };
+                rects[i] = sr;
+            }
+            if (!rects.empty())
+                SDL_UpdateRects(screen, rects.size(), &rects[0]);
+        } else {
+            canvas.resolve();
+            post.run(canvas.frame(), pscreen);
+            SDL_Flip(screen);
+        }
 
         angle += 0.01f;
     }
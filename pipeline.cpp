@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <sys/time.h>
+
+#include "pipeline.h"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+FramePipeline::FramePipeline(Pixman &surf, int buffers)
+    : m_started(buffers)
+    , m_stop(false)
+    , m_start(0)
+{
+    assert(buffers >= 1);
+    for (int i = 0; i < buffers; i++) {
+        m_canvases.push_back(new Canvas(surf));
+        m_free.push_back(i);
+    }
+    m_stats.frames = 0;
+    m_stats.elapsed = m_stats.latency = m_stats.maxLatency = 0;
+    m_stats.renderWait = m_stats.presentWait = 0;
+}
+
+FramePipeline::~FramePipeline()
+{
+    stop();
+    for (size_t i = 0; i < m_canvases.size(); i++)
+        delete m_canvases[i];
+}
+
+void FramePipeline::start(std::function<void(int, int)> render)
+{
+    assert(!m_thread.joinable());
+    m_render = render;
+    m_stop = false;
+    m_start = now();
+    m_thread = std::thread(&FramePipeline::run, this);
+}
+
+void FramePipeline::stop()
+{
+    if (!m_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_freed.notify_one();
+    m_thread.join();
+}
+
+// Render thread
+void FramePipeline::run()
+{
+    for (int n = 0; ; n++) {
+        int i;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            double t = now();
+            while (m_free.empty() && !m_stop)
+                m_freed.wait(lock);
+            m_stats.renderWait += now() - t;
+            if (m_stop)
+                return;
+            i = m_free.front();
+            m_free.pop_front();
+        }
+
+        m_started[i] = now();
+        m_render(i, n);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_ready.push_back(i);
+        }
+        m_done.notify_one();
+    }
+}
+
+int FramePipeline::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    double t = now();
+    while (m_ready.empty())
+        m_done.wait(lock);
+    m_stats.presentWait += now() - t;
+    int i = m_ready.front();
+    m_ready.pop_front();
+    return i;
+}
+
+void FramePipeline::release(int i)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        double t = now(), latency = t - m_started[i];
+        m_stats.frames++;
+        m_stats.elapsed = t - m_start;
+        m_stats.latency += (latency - m_stats.latency)/m_stats.frames;
+        m_stats.maxLatency = std::max(m_stats.maxLatency, latency);
+        m_free.push_back(i);
+    }
+    m_freed.notify_one();
+}
+
+FramePipeline::Stats FramePipeline::stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
@@ -0,0 +1,69 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "canvas.h"
+
+// Frames rendered on a thread of their own into one of a few canvases
+// while the caller presents the ones before. Finished frames queue up
+// in order. The render thread waits when every canvas holds a frame
+// not yet released, the caller when none is finished. One canvas makes
+// it serial, for comparison.
+class FramePipeline {
+public:
+    // Since start(), in seconds
+    struct Stats {
+        int frames;             // Released
+        double elapsed;
+        double latency;         // Mean, render start to release
+        double maxLatency;
+        double renderWait;      // Render thread blocked on a full queue
+        double presentWait;     // acquire() blocked on an empty one
+    };
+private:
+    std::vector<Canvas*> m_canvases;
+    std::vector<double> m_started; // Per canvas, its frame's render start
+    std::deque<int> m_free, m_ready;
+    std::function<void(int, int)> m_render;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_freed, m_done;
+    bool m_stop;
+    double m_start;
+    Stats m_stats;
+
+    void run();
+public:
+    // Canvases all present into surf
+    FramePipeline(Pixman &surf, int buffers = 2);
+    ~FramePipeline();
+
+    int buffers() const
+    {
+        return m_canvases.size();
+    }
+    // To set up before start(), drawn by the render thread after
+    Canvas& canvas(int i)
+    {
+        return *m_canvases[i];
+    }
+
+    // render(i, n) draws frame n into canvas(i), frames count from 0
+    void start(std::function<void(int, int)> render);
+    // Waits for the render thread to finish what it's drawing
+    void stop();
+
+    // Canvas of the oldest finished frame, waits for one
+    int acquire();
+    // Done presenting it, the render thread may draw into it again
+    void release(int i);
+
+    Stats stats();
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "pixman.h"
+
+// Surfaces bigger than this go to transparent huge pages
+static const size_t hugePage = 2 << 20;
+
+uint8_t *allocPixels(size_t size)
+{
+    size_t align = size >= hugePage ? hugePage : PIXMAN_ALIGN;
+    // Tail padding: 24-bit get() reads a whole word
+    size = (size + sizeof(uint32_t) + align-1) & ~(align-1);
+
+    void *p;
+    if (posix_memalign(&p, align, size))
+        abort();
+#ifdef MADV_HUGEPAGE
+    if (align == hugePage)
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return (uint8_t*)p;
+}
+
+void freePixels(uint8_t *p)
+{
+    free(p);
+}
+
+// Generic row conversion from xRGB8888, the compiler specializes it
+template <typename F>
+static void convertRow(const uint32_t *src, uint8_t *dst, unsigned n)
+{
+    for (unsigned x = 0; x < n; x++, dst += F::bpp)
+        F::store(dst, F::fromXRGB(src[x]));
+}
+
+// Pack 4 pixels into 3 words, little endian byte order
+static void convertRow24(const uint32_t *src, uint8_t *dst, unsigned n)
+{
+    unsigned x = 0;
+
+#ifdef __SSSE3__
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+                                       12, 13, 14, -1, -1, -1, -1);
+    for (; x+16 <= n; x += 16, dst += 48) {
+        const __m128i *s = (const __m128i*)(src+x);
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(s), pack);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(s+1), pack);
+        __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(s+2), pack);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(s+3), pack);
+        __m128i *o = (__m128i*)dst;
+        _mm_storeu_si128(o, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128(o+1, _mm_or_si128(_mm_srli_si128(b, 4),
+                                           _mm_slli_si128(c, 8)));
+        _mm_storeu_si128(o+2, _mm_or_si128(_mm_srli_si128(c, 8),
+                                           _mm_slli_si128(d, 4)));
+    }
+#endif
+
+    for (; x+4 <= n; x += 4, dst += 12) {
+        const uint32_t *p = src+x;
+        uint32_t w[3];
+        w[0] = (p[0] & 0xFFFFFF) | p[1] << 24;
+        w[1] = (p[1] >> 8 & 0xFFFF) | p[2] << 16;
+        w[2] = (p[2] >> 16 & 0xFF) | p[3] << 8;
+        memcpy(dst, w, 12);
+    }
+
+    convertRow<FormatRGB888>(src+x, dst, n-x);
+}
+
+static void convertRow565(const uint32_t *src, uint8_t *dst, unsigned n)
+{
+    unsigned x = 0;
+    uint16_t *d = (uint16_t*)dst;
+
+#ifdef __SSE2__
+    const __m128i mr = _mm_set1_epi32(0xF800);
+    const __m128i mg = _mm_set1_epi32(0x07E0);
+    const __m128i mb = _mm_set1_epi32(0x001F);
+    for (; x+8 <= n; x += 8) {
+        __m128i p[2];
+        for (int i = 0; i < 2; i++) {
+            __m128i c = _mm_loadu_si128((const __m128i*)(src+x)+i);
+            c = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 8), mr),
+                             _mm_and_si128(_mm_srli_epi32(c, 5), mg)),
+                _mm_and_si128(_mm_srli_epi32(c, 3), mb));
+            // Sign extend, so signed saturation in pack is a no-op
+            p[i] = _mm_srai_epi32(_mm_slli_epi32(c, 16), 16);
+        }
+        _mm_storeu_si128((__m128i*)(d+x), _mm_packs_epi32(p[0], p[1]));
+    }
+#endif
+
+    convertRow<FormatRGB565>(src+x, (uint8_t*)(d+x), n-x);
+}
+
+static void convertRowAny(const uint32_t *src, uint8_t *dst, unsigned n,
+                          Pixman &fmt, unsigned bpp)
+{
+    for (unsigned x = 0; x < n; x++, dst += bpp) {
+        uint32_t c = src[x];
+        uint32_t p = fmt.mapRGB(c >> 16, c >> 8, c);
+        memcpy(dst, &p, bpp);
+    }
+}
+
+static void fillRow32(uint32_t *d, unsigned n, uint32_t color)
+{
+    unsigned x = 0;
+
+#ifdef __SSE2__
+    const __m128i c = _mm_set1_epi32(color);
+    for (; x < n && ((uintptr_t)(d+x) & 15); x++)
+        d[x] = color;
+    for (; x+8 <= n; x += 8) {
+        _mm_store_si128((__m128i*)(d+x), c);
+        _mm_store_si128((__m128i*)(d+x)+1, c);
+    }
+#endif
+
+    for (; x < n; x++)
+        d[x] = color;
+}
+
+void Pixman::fill(int x, int y, int rw, int rh, uint32_t color)
+{
+    assert(x >= 0 && y >= 0 && x+rw <= (int)w && y+rh <= (int)h);
+
+    changes++;
+    for (int j = y; j < y+rh; j++) {
+        uint8_t *d = pixels(x, j);
+        switch (pf.bpp) {
+        case 4:
+            fillRow32((uint32_t*)d, rw, color);
+            break;
+        case 2:
+            std::fill_n((uint16_t*)d, rw, color);
+            break;
+        default:
+            // The first pixel is a pattern for the rest of the row
+            memcpy(d, &color, pf.bpp);
+            for (int i = 1; i < rw; i++)
+                memcpy(d+i*pf.bpp, d, pf.bpp);
+        }
+    }
+}
+
+void Pixman::copy(const Pixman &src, int sx, int sy, int rw, int rh,
+                  int dx, int dy)
+{
+    assert(src.pf.bpp == pf.bpp);
+    assert(sx >= 0 && sy >= 0 && sx+rw <= (int)src.w && sy+rh <= (int)src.h);
+    assert(dx >= 0 && dy >= 0 && dx+rw <= (int)w && dy+rh <= (int)h);
+
+    changes++;
+    for (int j = 0; j < rh; j++)
+        memmove(pixels(dx, dy+j), src.pixels(sx, sy+j), rw*pf.bpp);
+}
+
+void Pixman::convert(Pixman &dst, int x, int y, int rw, int rh) const
+{
+    assert(FormatXRGB8888::match(pf));
+    assert(dst.w == w && dst.h == h);
+    assert(x >= 0 && y >= 0 && x+rw <= (int)w && y+rh <= (int)h);
+
+    dst.changes++;
+    const PixelFormat &df = dst.pf;
+    for (int j = y; j < y+rh; j++) {
+        const uint32_t *s = (const uint32_t*)pixels(x, j);
+        uint8_t *d = dst.pixels(x, j);
+
+        if (FormatXRGB8888::match(df))
+            memcpy(d, s, rw*4);
+        else if (FormatRGB888::match(df))
+            convertRow24(s, d, rw);
+        else if (FormatRGB565::match(df))
+            convertRow565(s, d, rw);
+        else
+            convertRowAny(s, d, rw, dst, df.bpp);
+    }
+}
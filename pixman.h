@@ -2,57 +2,139 @@
 #define PIXMAN_H
 
 #include <cstring>
+#include <cassert>
 #include <stdint.h>
+#include <memory>
+#include <algorithm>
 
 struct PixelFormat {
     uint16_t bpp;
-    uint8_t mR, mG, mB, mA;
-    uint8_t sR, sG, sB, sA;
+    uint32_t mR, mG, mB, mA;    // masks
+    uint8_t sR, sG, sB, sA;     // shifts
+    uint8_t lR, lG, lB, lA;     // bits lost from 8-bit channel
 };
 
+// Rows of allocated surfaces start on a cache line
+enum { PIXMAN_ALIGN = 64 };
+
+// Aligned to PIXMAN_ALIGN, big surfaces are backed by huge pages where
+// the system supports them. Release with freePixels().
+uint8_t *allocPixels(size_t size);
+void freePixels(uint8_t *p);
+
 class Pixman {
-    const PixelFormat pf;
-    uint16_t w, h;
-    unsigned pitch;
-    size_t size;
+    PixelFormat pf;
+    uint32_t w, h;
+    size_t pitch;
+    // Allocated pixels are shared between a surface and its views,
+    // empty for foreign pixels
+    std::shared_ptr<uint8_t> buffer;
     uint8_t *colors;
-    bool allocated;
+    uint32_t changes;
+
+    static size_t defaultPitch(uint32_t w, const PixelFormat &pf)
+    {
+        size_t row = (size_t)pf.bpp*w;
+        return (row + PIXMAN_ALIGN-1) & ~(size_t)(PIXMAN_ALIGN-1);
+    }
+
+    void allocate()
+    {
+        buffer.reset(allocPixels(h*pitch), freePixels);
+        colors = buffer.get();
+    }
 
 public:
-    Pixman(uint16_t sw, uint16_t sh,
+    // pitch is in bytes, 0 means rows padded to a cache line for
+    // allocated surfaces and tightly packed for foreign ones
+    Pixman(uint32_t sw, uint32_t sh,
            const PixelFormat &pf,
-           uint8_t *scolors = NULL) :
+           uint8_t *scolors = NULL,
+           size_t spitch = 0) :
         pf(pf),
         w(sw), h(sh),
-        pitch(pf.bpp*w),
-        size(h*pitch+1),
-        colors(scolors ? scolors : new uint8_t[size]),
-        allocated(!scolors)
-    {}
+        pitch(spitch ? spitch :
+              scolors ? (size_t)pf.bpp*sw : defaultPitch(sw, pf)),
+        colors(scolors),
+        changes(0)
+    {
+        assert(pitch >= (size_t)pf.bpp*w);
+        if (!colors)
+            allocate();
+    }
 
+    // Deep copy, packed into a fresh buffer. Use view() to share.
     Pixman(const Pixman &src) :
+        pf(src.pf),
+        w(src.w),
+        h(src.h),
+        pitch(defaultPitch(w, pf)),
+        changes(0)
+    {
+        allocate();
+        for (uint32_t y = 0; y < h; y++)
+            memcpy(pixels(0, y), src.pixels(0, y), (size_t)pf.bpp*w);
+    }
+
+    Pixman(Pixman &&src) :
         pf(src.pf),
         w(src.w),
         h(src.h),
         pitch(src.pitch),
-        size(src.size),
-        colors(new uint8_t[size]),
-        allocated(true)
+        buffer(std::move(src.buffer)),
+        colors(src.colors),
+        changes(src.changes)
+    {
+        src.w = src.h = 0;
+        src.colors = NULL;
+    }
+
+    // Copies or moves, depending on how src was made
+    Pixman& operator=(Pixman src)
+    {
+        std::swap(pf, src.pf);
+        std::swap(w, src.w);
+        std::swap(h, src.h);
+        std::swap(pitch, src.pitch);
+        buffer.swap(src.buffer);
+        std::swap(colors, src.colors);
+        changes++;
+        return *this;
+    }
+
+    // Sub-rectangle sharing pixels (and the buffer reference) with
+    // this surface, nothing is copied. Views of foreign pixels don't
+    // keep them alive.
+    Pixman view(uint32_t x, uint32_t y, uint32_t vw, uint32_t vh) const
+    {
+        assert(x+vw <= w && y+vh <= h);
+        Pixman v(vw, vh, pf, pixels(x, y), pitch);
+        v.buffer = buffer;
+        return v;
+    }
+
+    // Bumped by every write through the methods here, whoever writes
+    // through pixels() calls touch(). Views count their own.
+    uint32_t version() const
     {
-        memcpy(colors, src.colors, h*pitch);
+        return changes;
+    }
+    void touch()
+    {
+        changes++;
     }
 
-    ~Pixman()
+    // Number of surfaces and views holding the pixels, 0 if foreign
+    long users() const
     {
-        if (allocated)
-            delete [] colors;
+        return buffer.use_count();
     }
 
-    uint16_t width() const
+    uint32_t width() const
     {
         return w;
     }
-    uint16_t height() const
+    uint32_t height() const
     {
         return h;
     }
@@ -64,12 +146,37 @@ public:
 
     uint32_t mapRGB(uint8_t r, uint8_t g, uint8_t b)
     {
-        return r << pf.sR | g << pf.sG | b << pf.sB | pf.mA;
+        return (r >> pf.lR) << pf.sR
+            | (g >> pf.lG) << pf.sG
+            | (b >> pf.lB) << pf.sB
+            | pf.mA;
     }
 
     uint32_t mapRGBA(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
     {
-        return r << pf.sR | g << pf.sG | b << pf.sB | (a << pf.sA & pf.mA);
+        return (r >> pf.lR) << pf.sR
+            | (g >> pf.lG) << pf.sG
+            | (b >> pf.lB) << pf.sB
+            | ((a >> pf.lA) << pf.sA & pf.mA);
+    }
+
+    size_t stride() const
+    {
+        return pitch;
+    }
+
+    uint8_t *pixels(uint32_t x = 0, uint32_t y = 0) const
+    {
+        return colors + y*pitch + x*pf.bpp;
+    }
+
+    // Pixel value to xRGB8888
+    uint32_t unmapRGB(uint32_t c) const
+    {
+        uint32_t r = ((c & pf.mR) >> pf.sR) << pf.lR;
+        uint32_t g = ((c & pf.mG) >> pf.sG) << pf.lG;
+        uint32_t b = ((c & pf.mB) >> pf.sB) << pf.lB;
+        return r << 16 | g << 8 | b;
     }
 
     uint32_t get(uint32_t x, uint32_t y) const
@@ -85,11 +192,160 @@ public:
         assert(y >= 0 && y < h);
         uint8_t *d = colors + y*pitch + x*pf.bpp;
         memcpy(d, &color, pf.bpp);
+        changes++;
     }
 
     void clear()
     {
-        memset(colors, 0, size);
+        changes++;
+        if (pitch == (size_t)pf.bpp*w)
+            memset(colors, 0, h*pitch);
+        else
+            for (uint32_t y = 0; y < h; y++)
+                memset(pixels(0, y), 0, (size_t)pf.bpp*w);
+    }
+
+    // Bulk operations on rectangles, the caller does the clipping
+    void fill(int x, int y, int rw, int rh, uint32_t color);
+    // Same format only
+    void copy(const Pixman &src, int sx, int sy, int rw, int rh,
+              int dx, int dy);
+    // Convert 32-bit xRGB pixels into dst of the same size, whatever
+    // its format is
+    void convert(Pixman &dst, int x, int y, int rw, int rh) const;
+    void convert(Pixman &dst) const
+    {
+        convert(dst, 0, 0, w, h);
+    }
+};
+
+// Compile-time pixel formats. Code touching pixels in a loop is
+// instantiated per format and the format is dispatched once, outside.
+// Values passed through toXRGB/fromXRGB are always xRGB8888.
+struct FormatXRGB8888 {
+    enum { bpp = 4 };
+
+    static bool match(const PixelFormat &f)
+    {
+        return f.bpp == 4
+            && f.sR == 16 && f.sG == 8 && f.sB == 0
+            && !f.lR && !f.lG && !f.lB;
+    }
+    static uint32_t load(const uint8_t *p)
+    {
+        return *(const uint32_t*)p;
+    }
+    static void store(uint8_t *p, uint32_t c)
+    {
+        *(uint32_t*)p = c;
+    }
+    static uint32_t toXRGB(uint32_t c)
+    {
+        return c;
+    }
+    static uint32_t fromXRGB(uint32_t c)
+    {
+        return c;
+    }
+};
+
+struct FormatRGB888 {
+    enum { bpp = 3 };
+
+    static bool match(const PixelFormat &f)
+    {
+        return f.bpp == 3
+            && f.sR == 16 && f.sG == 8 && f.sB == 0
+            && !f.lR && !f.lG && !f.lB;
+    }
+    static uint32_t load(const uint8_t *p)
+    {
+        return p[0] | p[1] << 8 | p[2] << 16;
+    }
+    static void store(uint8_t *p, uint32_t c)
+    {
+        p[0] = c;
+        p[1] = c >> 8;
+        p[2] = c >> 16;
+    }
+    static uint32_t toXRGB(uint32_t c)
+    {
+        return c;
+    }
+    static uint32_t fromXRGB(uint32_t c)
+    {
+        return c & 0xFFFFFF;
+    }
+};
+
+struct FormatRGB565 {
+    enum { bpp = 2 };
+
+    static bool match(const PixelFormat &f)
+    {
+        return f.bpp == 2
+            && f.sR == 11 && f.sG == 5 && f.sB == 0
+            && f.lR == 3 && f.lG == 2 && f.lB == 3;
+    }
+    static uint32_t load(const uint8_t *p)
+    {
+        return *(const uint16_t*)p;
+    }
+    static void store(uint8_t *p, uint32_t c)
+    {
+        *(uint16_t*)p = c;
+    }
+    // Replicate high bits into the low ones, so white stays white
+    static uint32_t toXRGB(uint32_t c)
+    {
+        uint32_t r = c >> 11 & 0x1F, g = c >> 5 & 0x3F, b = c & 0x1F;
+        r = r << 3 | r >> 2;
+        g = g << 2 | g >> 4;
+        b = b << 3 | b >> 2;
+        return r << 16 | g << 8 | b;
+    }
+    static uint32_t fromXRGB(uint32_t c)
+    {
+        return (c >> 8 & 0xF800) | (c >> 5 & 0x07E0) | (c >> 3 & 0x001F);
+    }
+};
+
+// Pixman seen through a compile-time format, no per-pixel format lookup
+template <typename F>
+class PixelView {
+    uint8_t *colors;
+    size_t pitch;
+    uint32_t w, h;
+
+public:
+    explicit PixelView(const Pixman &p)
+        : colors(p.pixels())
+        , pitch(p.stride())
+        , w(p.width())
+        , h(p.height())
+    {
+        assert(F::match(p.format()));
+    }
+
+    uint32_t width() const
+    {
+        return w;
+    }
+    uint32_t height() const
+    {
+        return h;
+    }
+
+    uint32_t get(uint32_t x, uint32_t y) const
+    {
+        assert(x < w && y < h);
+        return F::toXRGB(F::load(colors + y*pitch + x*F::bpp));
+    }
+
+    void set(uint32_t x, uint32_t y, uint32_t color)
+    {
+        assert(x < w && y < h);
+        F::store(colors + y*pitch + x*F::bpp, F::fromXRGB(color));
     }
 };
 
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "postfx.h"
+#include "simd.h"
+
+// Planar float copy of a tile and its border, passes read c and those
+// needing a second copy write t. Rows are padded so that 8 lanes may
+// run past the end.
+struct Planes {
+    float *c[3];
+    float *t[3];
+    float *luma;
+    int stride;
+    int w, h;
+    int fx, fy;                 // Frame position of (0, 0)
+    int fw, fh;                 // Frame size
+};
+
+void PostProcess::add(const Pass &p)
+{
+    m_passes.push_back(p);
+    m_border += p.radius;
+}
+
+void PostProcess::tonemap(float exposure)
+{
+    Pass p = { TONEMAP, 0, exposure };
+    add(p);
+}
+
+void PostProcess::blur(int radius)
+{
+    Pass p = { BLUR, radius, 0 };
+    float sigma = std::max(radius/2.f, 0.5f), sum = 0;
+    for (int i = -radius; i <= radius; i++) {
+        p.weights.push_back(expf(-i*i/(2*sigma*sigma)));
+        sum += p.weights.back();
+    }
+    for (size_t i = 0; i < p.weights.size(); i++)
+        p.weights[i] /= sum;
+    add(p);
+}
+
+void PostProcess::fxaa()
+{
+    Pass p = { FXAA, 1, 0 };
+    add(p);
+}
+
+void PostProcess::vignette(float strength)
+{
+    Pass p = { VIGNETTE, 0, strength };
+    add(p);
+}
+
+// Passes work on [m, w-m) x [m, h-m), the part still valid after the
+// passes before used up m of the border
+
+static void tonemapPass(Planes &pl, int m, float e)
+{
+    const float white = (1+e)/e;
+    for (int y = m; y < pl.h-m; y++)
+        for (int ch = 0; ch < 3; ch++) {
+            float *row = pl.c[ch] + y*pl.stride;
+            for (int x = m; x < pl.w-m; x += 8) {
+                float8 v = load8(row+x)*e;
+                store8(row+x, v/(1+v)*white);
+            }
+        }
+}
+
+static void vignettePass(Planes &pl, int m, float s)
+{
+    const float cx = pl.fw/2.f, cy = pl.fh/2.f;
+    const float8 lanes = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    for (int y = m; y < pl.h-m; y++) {
+        float dy = (pl.fy + y - cy)/cy;
+        for (int x = m; x < pl.w-m; x += 8) {
+            float8 dx = (lanes + float(pl.fx + x) - cx)/cx;
+            float8 f = 1 - s*0.5f*(dx*dx + dy*dy);
+            for (int ch = 0; ch < 3; ch++) {
+                float *p = pl.c[ch] + y*pl.stride + x;
+                store8(p, load8(p)*f);
+            }
+        }
+    }
+}
+
+// Horizontal into t, vertical back into c, channel by channel
+static void blurPass(Planes &pl, int m, const std::vector<float> &w)
+{
+    const int r = w.size()/2;
+    const int s = pl.stride;
+    for (int ch = 0; ch < 3; ch++) {
+        float *c = pl.c[ch], *t = pl.t[ch];
+        for (int y = m; y < pl.h-m; y++)
+            for (int x = m+r; x < pl.w-m-r; x += 8) {
+                const float *p = c + y*s + x - r;
+                float8 sum = float8{};
+                for (int k = 0; k <= 2*r; k++)
+                    sum += load8(p+k)*w[k];
+                store8(t + y*s + x, sum);
+            }
+        for (int y = m+r; y < pl.h-m-r; y++)
+            for (int x = m+r; x < pl.w-m-r; x += 8) {
+                const float *p = t + (y-r)*s + x;
+                float8 sum = float8{};
+                for (int k = 0; k <= 2*r; k++)
+                    sum += load8(p + k*s)*w[k];
+                store8(c + y*s + x, sum);
+            }
+    }
+}
+
+// Simplified FXAA: where the local luma contrast is high, blend toward
+// the neighbour across the edge by how much the pixel stands out of its
+// surroundings
+static void fxaaPass(Planes &pl, int m)
+{
+    const int s = pl.stride;
+    for (int y = m; y < pl.h-m; y++)
+        for (int x = m; x < pl.w-m; x += 8) {
+            int i = y*s + x;
+            store8(pl.luma+i, load8(pl.c[0]+i)*0.299f
+                   + load8(pl.c[1]+i)*0.587f + load8(pl.c[2]+i)*0.114f);
+        }
+
+    for (int y = m+1; y < pl.h-m-1; y++)
+        for (int x = m+1; x < pl.w-m-1; x += 8) {
+            const float *l = pl.luma + y*s + x;
+            float8 lm = load8(l);
+            float8 ln = load8(l-s), ls = load8(l+s);
+            float8 lw = load8(l-1), le = load8(l+1);
+            float8 lmin = min8(min8(min8(ln, ls), min8(lw, le)), lm);
+            float8 lmax = max8(max8(max8(ln, ls), max8(lw, le)), lm);
+            float8 range = lmax - lmin;
+
+            // Luma changing along y is a horizontal edge
+            mask8 horz = ge8(abs8(ln + ls - 2.f*lm), abs8(lw + le - 2.f*lm));
+            mask8 north = ge8(abs8(ln - lm), abs8(ls - lm));
+            mask8 west = ge8(abs8(lw - lm), abs8(le - lm));
+
+            float8 sub = abs8((ln + ls + lw + le)*0.25f - lm)/(range + 1e-6f);
+            sub = min8(sub, float8{} + 1);
+            float8 blend = sub*sub*0.75f;
+            mask8 edge = lt8(max8(float8{} + 0.0312f, lmax*0.125f), range);
+            blend = select8(edge, blend, float8{});
+
+            for (int ch = 0; ch < 3; ch++) {
+                const float *c = pl.c[ch] + y*s + x;
+                float8 cm = load8(c);
+                float8 nb = select8(horz,
+                                    select8(north, load8(c-s), load8(c+s)),
+                                    select8(west, load8(c-1), load8(c+1)));
+                store8(pl.t[ch] + y*s + x, cm + (nb - cm)*blend);
+            }
+        }
+
+    for (int ch = 0; ch < 3; ch++)
+        std::swap(pl.c[ch], pl.t[ch]);
+}
+
+void PostProcess::runTile(const Pixman &src, Pixman &dst, int x0, int y0,
+                          int tw, int th, std::vector<float> &scratch,
+                          std::vector<uint32_t> &packed) const
+{
+    const int b = m_border;
+    Planes pl;
+    pl.w = tw + 2*b;
+    pl.h = th + 2*b;
+    pl.stride = (pl.w + 7)/8*8 + 8;
+    pl.fx = x0 - b;
+    pl.fy = y0 - b;
+    pl.fw = src.width();
+    pl.fh = src.height();
+
+    size_t plane = (size_t)pl.stride*pl.h;
+    scratch.resize(plane*7);
+    for (int ch = 0; ch < 3; ch++) {
+        pl.c[ch] = &scratch[plane*ch];
+        pl.t[ch] = &scratch[plane*(3+ch)];
+    }
+    pl.luma = &scratch[plane*6];
+
+    // Border outside of the frame repeats the edge
+    const PixelFormat &pf = src.format();
+    const float k = 1/255.f;
+    for (int y = 0; y < pl.h; y++) {
+        int sy = std::min(std::max(pl.fy + y, 0), pl.fh-1);
+        const uint32_t *row = (const uint32_t*)src.pixels(0, sy);
+        float *r = pl.c[0] + y*pl.stride;
+        float *g = pl.c[1] + y*pl.stride;
+        float *bl = pl.c[2] + y*pl.stride;
+        for (int x = 0; x < pl.w; x++) {
+            uint32_t c = row[std::min(std::max(pl.fx + x, 0), pl.fw-1)];
+            r[x] = (c >> pf.sR & 0xFF)*k;
+            g[x] = (c >> pf.sG & 0xFF)*k;
+            bl[x] = (c >> pf.sB & 0xFF)*k;
+        }
+    }
+
+    int m = 0;
+    for (size_t i = 0; i < m_passes.size(); i++) {
+        const Pass &p = m_passes[i];
+        switch (p.effect) {
+        case TONEMAP:
+            tonemapPass(pl, m, p.param);
+            break;
+        case BLUR:
+            blurPass(pl, m, p.weights);
+            break;
+        case FXAA:
+            fxaaPass(pl, m);
+            break;
+        case VIGNETTE:
+            vignettePass(pl, m, p.param);
+            break;
+        }
+        m += p.radius;
+    }
+
+    // Pack the tile, then one conversion into dst
+    packed.resize((size_t)tw*th);
+    uint32_t *out = &packed[0];
+    for (int y = 0; y < th; y++)
+        for (int x = 0; x < tw; x++) {
+            int i = (b+y)*pl.stride + b + x;
+            uint32_t c = 0;
+            for (int ch = 0; ch < 3; ch++) {
+                float v = std::min(std::max(pl.c[ch][i], 0.f), 1.f);
+                c |= (uint32_t)(v*255 + 0.5f) << (ch == 0 ? pf.sR
+                                                  : ch == 1 ? pf.sG : pf.sB);
+            }
+            out[y*tw + x] = c;
+        }
+    Pixman tile(tw, th, pf, (uint8_t*)out, tw*sizeof(uint32_t));
+    Pixman view = dst.view(x0, y0, tw, th);
+    tile.convert(view);
+}
+
+void PostProcess::run(const Pixman &src, Pixman &dst) const
+{
+    assert(src.format().bpp == 4);
+    assert(src.width() == dst.width() && src.height() == dst.height());
+    assert(src.pixels() != dst.pixels());
+
+    const int w = src.width(), h = src.height();
+    const int tilesX = (w + TILE-1)/TILE;
+    const int tiles = tilesX*((h + TILE-1)/TILE);
+
+#pragma omp parallel
+    {
+        std::vector<float> scratch;
+        std::vector<uint32_t> packed;
+#pragma omp for schedule(dynamic)
+        for (int i = 0; i < tiles; i++) {
+            int x0 = i%tilesX*TILE, y0 = i/tilesX*TILE;
+            runTile(src, dst, x0, y0, std::min<int>(TILE, w-x0),
+                    std::min<int>(TILE, h-y0), scratch, packed);
+        }
+    }
+    dst.touch();
+}
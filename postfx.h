@@ -0,0 +1,55 @@
+#ifndef POSTFX_H
+#define POSTFX_H
+
+#include <vector>
+#include "pixman.h"
+
+// Effects on a finished 32-bit xRGB frame. Passes run in the order they
+// were added, all of them on one cache sized tile before the next, so
+// the frame is read once and the result written once. Tiles carry a
+// border wide enough for the neighbourhood of every pass and are spread
+// over the cores with OpenMP.
+class PostProcess {
+    enum Effect { TONEMAP, BLUR, FXAA, VIGNETTE };
+    struct Pass {
+        Effect effect;
+        int radius;             // Neighbourhood it reads
+        float param;
+        std::vector<float> weights;
+    };
+    std::vector<Pass> m_passes;
+    int m_border;
+
+    void add(const Pass &p);
+    void runTile(const Pixman &src, Pixman &dst, int x0, int y0,
+                 int tw, int th, std::vector<float> &scratch,
+                 std::vector<uint32_t> &packed) const;
+public:
+    enum { TILE = 64 };
+
+    PostProcess() : m_border(0) {}
+
+    // Reinhard curve, scaled so that white stays white
+    void tonemap(float exposure);
+    // Separable gaussian
+    void blur(int radius);
+    // Blends pixels on luma edges with the neighbour across the edge
+    void fxaa();
+    // Darkens toward the corners, strength 0..1
+    void vignette(float strength);
+    void clear()
+    {
+        m_passes.clear();
+        m_border = 0;
+    }
+    bool empty() const
+    {
+        return m_passes.empty();
+    }
+
+    // src is xRGB8888, dst the same size in any format: post-processing
+    // and presenting in one go. They can't share pixels.
+    void run(const Pixman &src, Pixman &dst) const;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Eight lanes, the compiler maps it to AVX or pairs of SSE registers
+typedef float float8 __attribute__((vector_size(32)));
+// Result of comparing float8s, all ones where true
+typedef int32_t mask8 __attribute__((vector_size(32)));
+
+static inline float8 load8(const float *p)
+{
+    float8 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store8(float *p, float8 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+#if defined(__SSE__) && !defined(__AVX__)
+// Without 256-bit registers GCC splits arithmetic into SSE pairs but
+// compares lane by lane with branches, so those go through SSE here
+union Split8 {
+    float8 v;
+    __m128 h[2];
+};
+
+#define SPLIT8_OP(name, intrin)                 \
+static inline float8 name(float8 a, float8 b)   \
+{                                               \
+    Split8 x = { a }, y = { b };                \
+    x.h[0] = intrin(x.h[0], y.h[0]);            \
+    x.h[1] = intrin(x.h[1], y.h[1]);            \
+    return x.v;                                 \
+}
+
+SPLIT8_OP(min8, _mm_min_ps)
+SPLIT8_OP(max8, _mm_max_ps)
+SPLIT8_OP(lt8f, _mm_cmplt_ps)
+SPLIT8_OP(ge8f, _mm_cmpge_ps)
+#undef SPLIT8_OP
+
+static inline mask8 lt8(float8 a, float8 b)
+{
+    return (mask8)lt8f(a, b);
+}
+
+static inline mask8 ge8(float8 a, float8 b)
+{
+    return (mask8)ge8f(a, b);
+}
+#else
+static inline mask8 lt8(float8 a, float8 b)
+{
+    return a < b;
+}
+
+static inline mask8 ge8(float8 a, float8 b)
+{
+    return a >= b;
+}
+
+static inline float8 min8(float8 a, float8 b)
+{
+    return a < b ? a : b;
+}
+
+static inline float8 max8(float8 a, float8 b)
+{
+    return a > b ? a : b;
+}
+#endif
+
+// m ? a : b per lane, m from lt8() and friends
+static inline float8 select8(mask8 m, float8 a, float8 b)
+{
+    return (float8)((m & (mask8)a) | (~m & (mask8)b));
+}
+
+static inline float8 max0(float8 x)
+{
+    return max8(x, float8{});
+}
+
+static inline float8 abs8(float8 x)
+{
+    return (float8)((mask8)x & 0x7FFFFFFF);
+}
+
+// { p[0], p[1], p[1], p[2], p[2], p[3], p[3], p[4] }, every value but
+// the ends twice, for stretching a row to twice its width
+static inline float8 spread8(const float *p)
+{
+#ifdef __SSE__
+    __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p+1);
+    union { float8 v; __m128 h[2]; } u;
+    u.h[0] = _mm_unpacklo_ps(a, b);
+    u.h[1] = _mm_unpackhi_ps(a, b);
+    return u.v;
+#else
+    float8 v = { p[0], p[1], p[1], p[2], p[2], p[3], p[3], p[4] };
+    return v;
+#endif
+}
+
+static inline float8 rsqrt(float8 x)
+{
+    float8 y;
+#ifdef __SSE__
+    union { float8 v; __m128 h[2]; } u = { x };
+    u.h[0] = _mm_rsqrt_ps(u.h[0]);
+    u.h[1] = _mm_rsqrt_ps(u.h[1]);
+    // One Newton-Raphson step on the estimate
+    y = u.v*(1.5f - 0.5f*x*u.v*u.v);
+#else
+    for (int i = 0; i < 8; i++)
+        y[i] = 1/sqrtf(x[i]);
+#endif
+    return y;
+}
+
+#endif
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <sys/time.h>
+
+#include "ssao.h"
+#include "simd.h"
+
+// Depth of pixels where nothing was drawn, never occludes
+static const float FAR = 1e30f;
+
+// Golden angle spiral out to 7 pixels, each is also sampled mirrored
+static const int samples[AmbientOcclusion::SAMPLES/2][2] = {
+    { 2, 0 }, { -2, 3 }, { -1, -5 }, { 5, 5 },
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+AmbientOcclusion::AmbientOcclusion()
+    : m_w(0), m_h(0)
+    , m_stride(0)
+    , m_radius(0.3f)
+    , m_strength(0.8f)
+{
+    m_cost.downsample = m_cost.occlusion = m_cost.upsample = 0;
+}
+
+// Borders start far and unoccluded. Depth is only written inside,
+// occlusion rows run 8 lanes at a time past m_w into the right border.
+void AmbientOcclusion::resize(int w, int h)
+{
+    if (w == m_w && h == m_h)
+        return;
+
+    m_w = w;
+    m_h = h;
+    // Room for 8 lanes running past the last tile
+    m_stride = (w + 2*KERNEL + 7)/8*8 + 8;
+    m_depth.assign((size_t)m_stride*(h + 2*KERNEL), FAR);
+    m_ao.assign(m_depth.size(), 1.f);
+}
+
+// Nearest of each 2x2
+void AmbientOcclusion::downsample(const Canvas &canvas)
+{
+    const float zs = 1.f/Canvas::DEPTH_SCALE;
+    const int fw = canvas.width(), fh = canvas.height();
+
+#pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < m_h; y++) {
+        const int32_t *r0 = canvas.depth(2*y);
+        const int32_t *r1 = canvas.depth(std::min(2*y+1, fh-1));
+        float *out = &m_depth[index(0, y)];
+        for (int x = 0; x < m_w; x++) {
+            int x1 = std::min(2*x+1, fw-1);
+            int32_t z = Canvas::depthOf(std::min(std::min(r0[2*x], r0[x1]),
+                                                 std::min(r1[2*x], r1[x1])));
+            out[x] = z == Canvas::DEPTH_FAR ? FAR : z*zs;
+        }
+    }
+}
+
+// Fraction of the sample pairs whose mean is closer to the eye than the
+// pixel, those much closer fade out. A plane sloping away has one sample
+// of each pair in front and one behind, so it doesn't shade itself.
+void AmbientOcclusion::occlusion()
+{
+    const int tilesX = (m_w + TILE-1)/TILE;
+    const int tiles = tilesX*((m_h + TILE-1)/TILE);
+    const float invR = 1/m_radius;
+    // Above the z-buffer step, so quantized slopes stay unshaded
+    const float bias = 0.02f*m_radius + 1.5f/Canvas::DEPTH_SCALE;
+    const float k = m_strength/(SAMPLES/2);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tiles; t++) {
+        int x0 = t%tilesX*TILE, y0 = t/tilesX*TILE;
+        int x1 = std::min<int>(x0+TILE, m_w), y1 = std::min<int>(y0+TILE, m_h);
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x += 8) {
+                const float *d = &m_depth[index(x, y)];
+                float8 zp = load8(d);
+                float8 occ = float8{};
+                for (int i = 0; i < SAMPLES/2; i++) {
+                    int off = samples[i][1]*m_stride + samples[i][0];
+                    float8 dz = zp - (load8(d + off) + load8(d - off))*0.5f;
+                    float8 fade = max0(1 - dz*invR);
+                    occ += select8(lt8(float8{} + bias, dz), fade, float8{});
+                }
+                store8(&m_ao[index(x, y)], max0(1 - occ*k));
+            }
+    }
+}
+
+// Bilinear weights times depth similarity, so occlusion doesn't bleed
+// across silhouettes, then into the frame. Full resolution pixel x sits
+// between half resolution (x-1)/2 and the next one, 1.5 and 0.5 full
+// pixels away for even x, the other way around for odd, so the near one
+// weighs 3/4.
+void AmbientOcclusion::upsample(Canvas &canvas)
+{
+    const float zs = 1.f/Canvas::DEPTH_SCALE;
+    const int fw = canvas.width(), fh = canvas.height();
+    Pixman &frame = canvas.frame();
+    frame.touch();              // Written through pixels()
+    // Weight of the left sample
+    const float8 tx = { 0.25f, 0.75f, 0.25f, 0.75f,
+                        0.25f, 0.75f, 0.25f, 0.75f };
+
+#pragma omp parallel for schedule(dynamic, 8)
+    for (int y = 0; y < fh; y++) {
+        const int32_t *zrow = canvas.depth(y);
+        uint32_t *row = (uint32_t*)frame.pixels(0, y);
+        int hy = (y-1) >> 1;
+        float ty = y & 1 ? 0.75f : 0.25f;
+        // Top left, top right, bottom left, bottom right
+        const float8 w[4] = { tx*ty, (1 - tx)*ty, tx*(1 - ty), (1 - tx)*(1 - ty) };
+        const float *d[2] = { &m_depth[index(-1, hy)], &m_depth[index(-1, hy+1)] };
+        const float *o[2] = { &m_ao[index(-1, hy)], &m_ao[index(-1, hy+1)] };
+
+        for (int x = 0; x < fw; x += 8) {
+            int n = std::min(8, fw-x);
+            // Empty pixels end up far enough not to matter
+            float zl[8];
+            for (int l = 0; l < 8; l++)
+                zl[l] = Canvas::depthOf(zrow[x + std::min(l, n-1)])*zs;
+            float8 z = load8(zl);
+
+            // Lane l reads half resolution (x+l-1)/2 and the next
+            float8 sum = float8{}, wsum = float8{};
+            for (int j = 0; j < 2; j++) {
+                const float *dl = d[j] + x/2, *ol = o[j] + x/2;
+                float8 wl = w[2*j]/(1e-3f + abs8(z - spread8(dl)));
+                float8 wr = w[2*j+1]/(1e-3f + abs8(z - spread8(dl+1)));
+                sum += wl*spread8(ol) + wr*spread8(ol+1);
+                wsum += wl + wr;
+            }
+            float8 a = sum/(wsum + 1e-12f)*256;
+
+            for (int l = 0; l < n; l++) {
+                if (Canvas::depthOf(zrow[x+l]) == Canvas::DEPTH_FAR)
+                    continue;
+                uint32_t c = row[x+l], m = a[l];
+                uint32_t rb = (c & 0xFF00FF)*m >> 8 & 0xFF00FF;
+                uint32_t g = (c & 0xFF00)*m >> 8 & 0xFF00;
+                row[x+l] = rb | g;
+            }
+        }
+    }
+}
+
+void AmbientOcclusion::apply(Canvas &canvas)
+{
+    canvas.resolve();
+    resize((canvas.width()+1)/2, (canvas.height()+1)/2);
+
+    double t0 = now();
+    downsample(canvas);
+    double t1 = now();
+    occlusion();
+    double t2 = now();
+    upsample(canvas);
+    double t3 = now();
+
+    m_cost.downsample = t1 - t0;
+    m_cost.occlusion = t2 - t1;
+    m_cost.upsample = t3 - t2;
+}
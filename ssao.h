@@ -0,0 +1,63 @@
+#ifndef SSAO_H
+#define SSAO_H
+
+#include <vector>
+#include "canvas.h"
+
+// Screen space ambient occlusion from the z-buffer alone. Depth is
+// halved, occlusion sampled at half resolution, then upsampled with
+// depth aware weights and multiplied into the frame. Tiles run on all
+// cores with OpenMP.
+class AmbientOcclusion {
+public:
+    // Seconds each pass of the last apply() took
+    struct Cost {
+        double downsample;
+        double occlusion;
+        double upsample;
+    };
+
+    enum { SAMPLES = 8, KERNEL = 8, TILE = 64 };
+
+    AmbientOcclusion();
+
+    // Occluders further than radius in front of a pixel don't count
+    void radius(float r)
+    {
+        m_radius = r;
+    }
+    // 0..1, how dark a fully occluded pixel gets
+    void strength(float s)
+    {
+        m_strength = s;
+    }
+
+    // Samples are a fixed pattern up to KERNEL half resolution pixels
+    // away, depth is all that is needed
+    void apply(Canvas &canvas);
+
+    const Cost& cost() const
+    {
+        return m_cost;
+    }
+
+private:
+    std::vector<float> m_depth; // Half resolution, KERNEL pixels of border
+    std::vector<float> m_ao;    // Same layout
+    int m_w, m_h;
+    int m_stride;
+    float m_radius;
+    float m_strength;
+    Cost m_cost;
+
+    void resize(int w, int h);
+    void downsample(const Canvas &canvas);
+    void occlusion();
+    void upsample(Canvas &canvas);
+    size_t index(int x, int y) const
+    {
+        return (size_t)(y+KERNEL)*m_stride + x+KERNEL;
+    }
+};
+
+#endif
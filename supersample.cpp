@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cmath>
+
+#include "supersample.h"
+#include "simd.h"
+
+// xRGB8888, as the canvas renders
+static const PixelFormat bandFormat = {
+    4,
+    0xFF0000, 0x00FF00, 0x0000FF, 0,
+    16, 8, 0, 24,
+    0, 0, 0, 8
+};
+
+// Kernel taps start this many source pixels from the first one under
+// the output pixel
+static int firstTap(Supersampler::Filter filter, int factor)
+{
+    return filter == Supersampler::BOX ? 0 : -(3*factor)/2;
+}
+
+// Lanczos with a = 2 output pixels, or a box over the factor x factor
+// source pixels. Weights sum to 1.
+static std::vector<float> kernel(Supersampler::Filter filter, int factor,
+                                 int k0)
+{
+    std::vector<float> w;
+    if (filter == Supersampler::BOX) {
+        w.assign(factor, 1.f/factor);
+        return w;
+    }
+
+    float sum = 0;
+    for (int k = k0; ; k++) {
+        // Distance of the source pixel center in output pixels
+        float d = (k + 0.5f - factor/2.f)/factor;
+        if (d >= 2)
+            break;
+        float l = 1;
+        if (d != 0)
+            l = 2*sinf(M_PI*d)*sinf(M_PI*d/2)/(M_PI*M_PI*d*d);
+        w.push_back(l);
+        sum += l;
+    }
+    for (size_t i = 0; i < w.size(); i++)
+        w[i] /= sum;
+    return w;
+}
+
+Supersampler::Supersampler(int width, int height, int factor,
+                           Filter filter, int bandRows)
+    : m_width(width), m_height(height)
+    , m_factor(factor)
+    , m_bandRows(bandRows)
+    , m_k0(firstTap(filter, factor))
+    , m_weights(kernel(filter, factor, m_k0))
+    , m_surface(width*factor, (bandRows-1)*factor + m_weights.size(),
+                bandFormat)
+    , m_canvas(m_surface)
+{
+}
+
+// Source rows are spread into factor planes by x modulo factor, then
+// tap k of every output pixel is one contiguous run in one plane.
+// Filtered along x into m_rows, then along y straight into out.
+void Supersampler::filterBand(Pixman &out, int oy, int rows)
+{
+    const int f = m_factor, taps = m_weights.size();
+    const int sw = width(), sh = height();
+    const int top = oy*f + m_k0;  // Image row of canvas row 0
+    const int srcRows = (rows-1)*f + taps;
+    // Source x is shifted right by s, a multiple of f, so that the
+    // first tap isn't left of plane 0
+    const int s = (-m_k0 + f-1)/f*f;
+    const int plane = m_width + (m_k0 + taps-1 + s)/f + 8;
+    const int stride = (m_width + 7)/8*8;
+    const float *w = &m_weights[0];
+    const Pixman &frame = m_canvas.frame();
+
+    m_rows.resize((size_t)srcRows*3*stride);
+
+#pragma omp parallel
+    {
+        std::vector<float> phases((size_t)3*f*plane);
+        std::vector<uint32_t> line(stride);
+
+#pragma omp for schedule(dynamic, 4)
+        for (int r = 0; r < srcRows; r++) {
+            // Rows past the image edge repeat it
+            int y = std::min(std::max(top + r, 0), sh-1) - top;
+            const uint32_t *src = (const uint32_t*)frame.pixels(0, y);
+            for (int p = 0; p < f; p++) {
+                float *pr = &phases[(size_t)(0*f + p)*plane];
+                float *pg = &phases[(size_t)(1*f + p)*plane];
+                float *pb = &phases[(size_t)(2*f + p)*plane];
+                for (int j = 0; j < plane; j++) {
+                    int x = std::min(std::max(j*f + p - s, 0), sw-1);
+                    uint32_t c = src[x];
+                    pr[j] = c >> 16 & 0xFF;
+                    pg[j] = c >> 8 & 0xFF;
+                    pb[j] = c & 0xFF;
+                }
+            }
+
+            for (int ch = 0; ch < 3; ch++) {
+                float *dst = &m_rows[((size_t)r*3 + ch)*stride];
+                for (int x = 0; x < m_width; x += 8) {
+                    float8 sum = float8{};
+                    for (int t = 0; t < taps; t++) {
+                        int k = m_k0 + t + s;
+                        sum += load8(&phases[(size_t)(ch*f + k%f)*plane
+                                             + x + k/f])*w[t];
+                    }
+                    store8(dst + x, sum);
+                }
+            }
+        }
+
+#pragma omp for schedule(dynamic, 4)
+        for (int i = 0; i < rows; i++) {
+            for (int x = 0; x < m_width; x += 8) {
+                mask8 c = mask8{};
+                for (int ch = 0; ch < 3; ch++) {
+                    float8 sum = float8{};
+                    for (int t = 0; t < taps; t++)
+                        sum += load8(&m_rows[((size_t)(i*f + t)*3 + ch)*stride
+                                             + x])*w[t];
+                    // Lanczos lobes overshoot
+                    sum = min8(max0(sum), float8{} + 255) + 0.5f;
+                    c = c << 8 | __builtin_convertvector(sum, mask8);
+                }
+                memcpy(&line[x], &c, sizeof(c));
+            }
+            Pixman src(m_width, 1, bandFormat,
+                       (uint8_t*)&line[0]);
+            Pixman dst = out.view(0, oy+i, m_width, 1);
+            src.convert(dst);
+        }
+    }
+    out.touch();
+}
@@ -0,0 +1,62 @@
+#ifndef SUPERSAMPLE_H
+#define SUPERSAMPLE_H
+
+#include <vector>
+#include "canvas.h"
+
+// Offline rendering at factor times the output resolution. The big
+// image is drawn a band of rows at a time into canvas() and filtered
+// down into the output right away, so it is never whole in memory.
+// Bands overlap by the filter support. Filtering is separable, 8-wide
+// and spread over the cores with OpenMP.
+class Supersampler {
+public:
+    enum Filter { BOX, LANCZOS };
+private:
+    int m_width, m_height;      // Output
+    int m_factor;
+    int m_bandRows;             // Output rows per band
+    int m_k0;                   // Source offset of the first tap
+    std::vector<float> m_weights; // Kernel, the same for every pixel
+    Pixman m_surface;
+    Canvas m_canvas;
+    std::vector<float> m_rows;  // Band filtered along x
+
+    void filterBand(Pixman &out, int oy, int rows);
+public:
+    Supersampler(int width, int height, int factor,
+                 Filter filter = LANCZOS, int bandRows = 32);
+
+    // Band being drawn, the width of the supersampled image
+    Canvas& canvas()
+    {
+        return m_canvas;
+    }
+
+    // Supersampled image
+    int width() const
+    {
+        return m_width*m_factor;
+    }
+    int height() const
+    {
+        return m_height*m_factor;
+    }
+
+    // draw(y) renders the supersampled image from row y down into
+    // canvas(). y is negative for the first band, the last runs past
+    // the bottom, rows outside of the image aren't used.
+    template <typename F>
+    void render(Pixman &out, F draw)
+    {
+        assert((int)out.width() == m_width);
+        assert((int)out.height() == m_height);
+        for (int oy = 0; oy < m_height; oy += m_bandRows) {
+            draw(oy*m_factor + m_k0);
+            m_canvas.resolve();
+            filterBand(out, oy, std::min(m_bandRows, m_height-oy));
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <cmath>
+#include <cstdlib>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "texture.h"
+
+static uint32_t avg4(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    uint32_t rb = (a & 0xFF00FF) + (b & 0xFF00FF)
+        + (c & 0xFF00FF) + (d & 0xFF00FF) + 0x020002;
+    uint32_t g = (a & 0x00FF00) + (b & 0x00FF00)
+        + (c & 0x00FF00) + (d & 0x00FF00) + 0x000200;
+    return (rb >> 2 & 0xFF00FF) | (g >> 2 & 0x00FF00);
+}
+
+// 2x2 box filter of a row-major level, odd last row/column is dropped
+static void downsample(const uint32_t *src, uint32_t sw, uint32_t sh,
+                       uint32_t *dst, uint32_t dw, uint32_t dh)
+{
+    for (uint32_t y = 0; y < dh; y++) {
+        const uint32_t *r0 = src + (size_t)2*y*sw;
+        const uint32_t *r1 = sh > 1 ? r0 + sw : r0;
+        uint32_t *d = dst + (size_t)y*dw;
+        uint32_t x = 0;
+
+#ifdef __SSE2__
+        // Average rows, then even and odd columns. Two rounding
+        // averages are biased up by at most one.
+        for (; x+4 <= dw && sw > 1; x += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(r0+2*x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(r0+2*x+4));
+            __m128i c = _mm_loadu_si128((const __m128i*)(r1+2*x));
+            __m128i e = _mm_loadu_si128((const __m128i*)(r1+2*x+4));
+            __m128 v0 = _mm_castsi128_ps(_mm_avg_epu8(a, c));
+            __m128 v1 = _mm_castsi128_ps(_mm_avg_epu8(b, e));
+            __m128i even = _mm_castps_si128(
+                _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(
+                _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+            _mm_storeu_si128((__m128i*)(d+x), _mm_avg_epu8(even, odd));
+        }
+#endif
+
+        for (; x < dw; x++) {
+            uint32_t x0 = 2*x, x1 = std::min(2*x+1, sw-1);
+            d[x] = avg4(r0[x0], r0[x1], r1[x0], r1[x1]);
+        }
+    }
+}
+
+Texture::Texture(const Pixman &src, bool mipmap)
+{
+    // Level sizes and offsets into one allocation
+    size_t total = 0;
+    uint32_t w = src.width(), h = src.height();
+    for (;;) {
+        Level l;
+        l.w = w;
+        l.h = h;
+        l.tilesX = (w + TILE-1) >> TILE_SHIFT;
+        l.texels = (uint32_t*)total;
+        total += (size_t)l.tilesX*((h + TILE-1) >> TILE_SHIFT)*TILE*TILE;
+        m_levels.push_back(l);
+
+        if (!mipmap || (w == 1 && h == 1))
+            break;
+        w = std::max(w/2, 1u);
+        h = std::max(h/2, 1u);
+    }
+
+    m_texels = (uint32_t*)allocPixels(total*sizeof(uint32_t));
+    memset(m_texels, 0, total*sizeof(uint32_t));
+    for (size_t i = 0; i < m_levels.size(); i++)
+        m_levels[i].texels = m_texels + (size_t)m_levels[i].texels;
+
+    m_version = 0;
+    load(src);
+}
+
+void Texture::load(const Pixman &src)
+{
+    assert(src.width() == width() && src.height() == height());
+
+    // Filter in row-major order, then tile
+    std::vector<uint32_t> cur((size_t)width()*height()), next;
+    for (uint32_t y = 0; y < height(); y++)
+        for (uint32_t x = 0; x < width(); x++)
+            cur[(size_t)y*width()+x] = src.unmapRGB(src.get(x, y));
+
+    for (size_t i = 0; i < m_levels.size(); i++) {
+        const Level &l = m_levels[i];
+        if (i > 0) {
+            const Level &p = m_levels[i-1];
+            next.resize((size_t)l.w*l.h);
+            downsample(&cur[0], p.w, p.h, &next[0], l.w, l.h);
+            cur.swap(next);
+        }
+        for (uint32_t y = 0; y < l.h; y++)
+            for (uint32_t x = 0; x < l.w; x++)
+                l.texels[l.index(x, y)] = cur[(size_t)y*l.w+x];
+    }
+    m_version++;
+}
+
+Texture::~Texture()
+{
+    freePixels((uint8_t*)m_texels);
+}
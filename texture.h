@@ -0,0 +1,123 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <cmath>
+#include <vector>
+#include "pixman.h"
+
+// Interpolate packed xRGB8888, t is 0..256
+static inline uint32_t lerpRGB(uint32_t a, uint32_t b, uint32_t t)
+{
+    uint32_t rb = ((a & 0xFF00FF)*(256-t) + (b & 0xFF00FF)*t) >> 8;
+    uint32_t g = ((a & 0x00FF00)*(256-t) + (b & 0x00FF00)*t) >> 8;
+    return (rb & 0xFF00FF) | (g & 0x00FF00);
+}
+
+// Texels stored in 4x4 tiles, a tile is one cache line of xRGB8888.
+// Neighbours in both u and v are close in memory, so sampling along
+// any direction touches few lines.
+//
+// The mip chain is built at load with a 2x2 box filter, every level is
+// tiled the same way and all of them live in one allocation.
+// Coordinates are always in level 0 texels.
+class Texture {
+    enum { TILE_SHIFT = 2, TILE = 1 << TILE_SHIFT };
+
+    struct Level {
+        uint32_t w, h;
+        uint32_t tilesX;
+        uint32_t *texels;
+
+        size_t index(uint32_t x, uint32_t y) const
+        {
+            size_t tile = (size_t)(y >> TILE_SHIFT)*tilesX + (x >> TILE_SHIFT);
+            return tile << (2*TILE_SHIFT)
+                | (y & (TILE-1)) << TILE_SHIFT
+                | (x & (TILE-1));
+        }
+
+        uint32_t get(uint32_t x, uint32_t y) const
+        {
+            assert(x < w && y < h);
+            return texels[index(x, y)];
+        }
+    };
+
+    std::vector<Level> m_levels;
+    uint32_t *m_texels;
+    uint32_t m_version;
+
+public:
+    enum Filter { NEAREST, BILINEAR, TRILINEAR };
+
+    // Converted once, the source isn't referenced afterwards
+    explicit Texture(const Pixman &src, bool mipmap = true);
+    ~Texture();
+
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+
+    // New texels from src of the same size, mip chain rebuilt
+    void load(const Pixman &src);
+    // Bumped by every load()
+    uint32_t version() const
+    {
+        return m_version;
+    }
+
+    uint32_t width() const
+    {
+        return m_levels[0].w;
+    }
+    uint32_t height() const
+    {
+        return m_levels[0].h;
+    }
+    int levels() const
+    {
+        return m_levels.size();
+    }
+
+    // xRGB8888
+    uint32_t get(uint32_t x, uint32_t y, int level = 0) const
+    {
+        return m_levels[level].get(x, y);
+    }
+
+    uint32_t nearest(float u, float v, int level) const
+    {
+        const Level &l = m_levels[level];
+        uint32_t x = u*(1.0f/(1 << level));
+        uint32_t y = v*(1.0f/(1 << level));
+        return l.get(std::min(x, l.w-1), std::min(y, l.h-1));
+    }
+
+    uint32_t bilinear(float u, float v, int level) const
+    {
+        const Level &l = m_levels[level];
+        // 8 bits of sub-texel position
+        int32_t fu = u*(256.0f/(1 << level));
+        int32_t fv = v*(256.0f/(1 << level));
+        uint32_t x0 = std::min<uint32_t>(std::max(fu >> 8, 0), l.w-1);
+        uint32_t y0 = std::min<uint32_t>(std::max(fv >> 8, 0), l.h-1);
+        uint32_t x1 = std::min(x0+1, l.w-1);
+        uint32_t y1 = std::min(y0+1, l.h-1);
+        uint32_t tx = fu & 0xFF, ty = fv & 0xFF;
+
+        uint32_t top = lerpRGB(l.get(x0, y0), l.get(x1, y0), tx);
+        uint32_t bottom = lerpRGB(l.get(x0, y1), l.get(x1, y1), tx);
+        return lerpRGB(top, bottom, ty);
+    }
+
+    // Level of detail from texel footprint of a pixel, derivatives are
+    // in level 0 texels per pixel
+    float lod(float dudx, float dvdx, float dudy, float dvdy) const
+    {
+        float rx = dudx*dudx + dvdx*dvdx;
+        float ry = dudy*dudy + dvdy*dvdy;
+        float l = 0.5f*log2f(std::max(rx, ry));
+        return std::min(std::max(l, 0.0f), float(m_levels.size()-1));
+    }
+};
+
+#endif
@@ -79,7 +79,22 @@ Matrix<4, 4, T> rotate(T a, T x, T y, T z)
     return Matrix<4, 4, T>(R);
 }
 
+template <typename T>
+Matrix<3, 3, T> normalMatrix(const Matrix<4, 4, T> &m)
+{
+    vec<3, T> c0 = m[0], c1 = m[1], c2 = m[2];
+    vec<3, T> cof[3] = { cross(c1, c2), cross(c2, c0), cross(c0, c1) };
+
+    // Keep the orientation for mirroring transforms
+    if (dot(c0, cof[0]) < 0)
+        for (int i = 0; i < 3; i++)
+            cof[i] = -cof[i];
+
+    return Matrix<3, 3, T>(cof);
+}
+
 // Provide implementation
 template Matrix4f scale(float, float, float);
 template Matrix4f translate(float, float, float);
 template Matrix4f rotate(float, float, float, float);
+template Matrix<3, 3, float> normalMatrix(const Matrix4f &);
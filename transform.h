@@ -15,4 +15,9 @@ Matrix<4, 4, T> translate(T tx, T ty, T tz);
 template <typename T>
 Matrix<4, 4, T> rotate(T a, T x, T y, T z);
 
+// Inverse transpose of the upper 3x3, for transforming normals. Not
+// scaled by the determinant, normals need normalizing anyway.
+template <typename T>
+Matrix<3, 3, T> normalMatrix(const Matrix<4, 4, T> &m);
+
 #endif
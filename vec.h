@@ -134,6 +134,9 @@ static T dot(const vec<N, T> &a, const vec<N, T> &b)
 	return sum;
 }
 
+template <typename T>
+vec<3, T> vec3(T a, T b, T c);
+
 template <typename T>
 static vec<3, T> cross(const vec<3, T> &a, const vec<3, T> &b)
 {